@@ -5,5 +5,13 @@
 
 #define smal_likely(x)       __builtin_expect((x) != 0,1)
 #define smal_unlikely(x)     __builtin_expect((x) != 0,0)
+#define smal_always_inline   inline __attribute__((always_inline))
+
+/* Storage class of per-marker state. */
+#if SMAL_PARALLEL_MARK
+#define smal_mark_TLS __thread
+#else
+#define smal_mark_TLS
+#endif
 
 #endif
@@ -20,6 +20,15 @@
 #define SMAL_SEGREGATE_BUFFER_FROM_PAGE 1
 #endif
 
+/* If true, on Linux the buffer write barrier uses soft-dirty page bits instead of mprotect(), if the kernel has them. */
+#ifndef SMAL_SOFT_DIRTY
+#if SMAL_BUFFER_WRITE_BARRIER && defined(__linux__)
+#define SMAL_SOFT_DIRTY 1
+#else
+#define SMAL_SOFT_DIRTY 0
+#endif
+#endif
+
 #ifndef SMAL_MARK_QUEUE
 #define SMAL_MARK_QUEUE 1
 #endif
@@ -28,6 +37,98 @@
 #define SMAL_REMEMBERED_SET 1
 #endif
 
+/* If true, the buffer write barrier tracks mutation, protection and remembered sets per OS page ("slice") of a buffer. */
+#ifndef SMAL_WRITE_BARRIER_SLICES
+#define SMAL_WRITE_BARRIER_SLICES (SMAL_BUFFER_WRITE_BARRIER && SMAL_REMEMBERED_SET && SMAL_MARK_QUEUE)
+#endif
+
+#ifndef SMAL_ALLOC_CACHE
+#define SMAL_ALLOC_CACHE 1
+#endif
+
+#ifndef SMAL_ARENA
+#define SMAL_ARENA 1
+#endif
+
+#ifndef SMAL_BUFFER_POOL
+#define SMAL_BUFFER_POOL 1
+#endif
+
+/* If true, smal_mark_ptr_range() only considers pointer-aligned words. */
+#ifndef SMAL_MARK_RANGE_ALIGNED
+#define SMAL_MARK_RANGE_ALIGNED 0
+#endif
+
+/* If true, smal_mark_ptr_range() filters words with GCC vector extensions. */
+#ifndef SMAL_MARK_RANGE_SIMD
+#ifdef __GNUC__
+#define SMAL_MARK_RANGE_SIMD 1
+#else
+#define SMAL_MARK_RANGE_SIMD 0
+#endif
+#endif
+
+/* If true, types with an object_size in SMAL_SIZE_KERNEL_SIZES use size-specialized sweep and allocation routines. */
+#ifndef SMAL_SIZE_KERNELS
+#define SMAL_SIZE_KERNELS 1
+#endif
+
+/* Object sizes given specialized routines, as an X-macro: K(SIZE) for each SIZE, a multiple of sizeof(double). */
+#ifndef SMAL_SIZE_KERNEL_SIZES
+#define SMAL_SIZE_KERNEL_SIZES(K) K(16) K(24) K(32) K(48)
+#endif
+
+/* If true, the mark queue prefetches objects and mark bits a few entries before marking them. */
+#ifndef SMAL_MARK_PREFETCH
+#define SMAL_MARK_PREFETCH 1
+#endif
+
+/* If true, smal_collect_start() and smal_collect_step() collect incrementally. */
+#ifndef SMAL_INCREMENTAL
+#define SMAL_INCREMENTAL SMAL_MARK_QUEUE
+#endif
+
+/* If true, types with desc.card_marking track mutation with cards set by smal_write_barrier(), instead of write protection. */
+#ifndef SMAL_CARD_MARKING
+#define SMAL_CARD_MARKING 1
+#endif
+
+/* log2 of the bytes covered by a card. */
+#ifndef smal_card_SHIFT
+#define smal_card_SHIFT 9
+#endif
+#define smal_card_SIZE ((size_t) 1 << smal_card_SHIFT)
+
+/* If true, buffers start or stop tracking mutation with the write barrier by how often they are mutated; see smal_write_barrier_adapt. */
+#ifndef SMAL_ADAPTIVE_WRITE_BARRIER
+#define SMAL_ADAPTIVE_WRITE_BARRIER SMAL_BUFFER_WRITE_BARRIER
+#endif
+
+/* If true, smal_collect_minor() marks only objects allocated since the last collection. */
+#ifndef SMAL_GENERATIONAL
+#define SMAL_GENERATIONAL SMAL_MARK_QUEUE
+#endif
+
+/* If true, smal_collect() marks with smal_mark_threads threads. */
+#ifndef SMAL_PARALLEL_MARK
+#if SMAL_PTHREAD && SMAL_MARK_QUEUE
+#define SMAL_PARALLEL_MARK 1
+#else
+#define SMAL_PARALLEL_MARK 0
+#endif
+#endif
+
+/* If true, smal_collect_start_concurrent() marks in a background thread. */
+#ifndef SMAL_CONCURRENT_MARK
+#define SMAL_CONCURRENT_MARK (SMAL_PARALLEL_MARK && SMAL_INCREMENTAL)
+#endif
+
+/* Bit mask of smal_stats_BIT() counters maintained for smal_type_stats() and smal_global_stats().
+   smal_buffer stats are always maintained. */
+#ifndef SMAL_STATS_MASK
+#define SMAL_STATS_MASK (~ 0UL)
+#endif
+
 
 #define smal_alignedQ(ptr,align) (((size_t)(ptr) % (align)) == 0)
 #define smal_ALIGN(ptr,align) if ( (size_t)(ptr) % (align) ) (ptr) += (align) - ((size_t)(ptr) % (align))
@@ -81,9 +182,17 @@ struct smal_stats {
   size_t mmap_total; /** total bytes mmap()ed, may wrap. */
   size_t malloc_overhead_size; /* bytes mmalloc()ed. */
   size_t buffer_mutations; /** mutations: valid only for buffers with dirty_write_barrier.  */
+  size_t slice_mutations; /** OS pages of buffers first written since the last collection; see SMAL_WRITE_BARRIER_SLICES. */
+  size_t write_barrier_disables; /** buffers that stopped tracking mutation; see SMAL_ADAPTIVE_WRITE_BARRIER. */
+  size_t write_barrier_enables; /** buffers that started tracking mutation; see SMAL_ADAPTIVE_WRITE_BARRIER. */
+  size_t retained_size; /** bytes of empty buffers retained for reuse; not included in mmap_size. */
+  size_t decommitted_size; /** bytes of retained buffers returned to the OS. */
   smal_thread_mutex _mutex;
 };
 extern const char *smal_stats_names[];
+#define smal_stats_BIT(N) (1UL << (offsetof(smal_stats, N) / sizeof(size_t)))
+
+struct smal_stats_shard;
 
 struct smal_type_descriptor {
   size_t object_size;
@@ -92,6 +201,7 @@ struct smal_type_descriptor {
   smal_free_func free_func;
   int collections_per_sweep;
   int mostly_unchanging;
+  int card_marking; /** If true, pointer stores into objects must use smal_write_barrier(), which sets cards; see SMAL_CARD_MARKING. */
   void *opaque;
 };
 
@@ -104,8 +214,19 @@ struct smal_type {
   smal_buffer *alloc_buffer; /** The buffer to allocate from. */
   smal_thread_mutex alloc_buffer_mutex;
   smal_stats stats; /** Stats for this smal_type. */
+  struct smal_stats_shard *stats_shards; /** Sharded counters summed into stats by smal_type_stats(). */
+#if SMAL_BUFFER_POOL
+  smal_buffer *retained; /** Empty buffers retained for reuse. */
+#endif
+#if SMAL_SIZE_KERNELS
+  const struct smal_size_kernel *kernel; /** Routines specialized for desc.object_size, or 0. */
+#endif
 };
 
+/* Lock-free free list head:
+   offset of the first object from mmap_addr in the low 32 bits, ABA tag in the high 32 bits. */
+typedef unsigned long long smal_free_list_head;
+
 struct smal_bitmap {
   size_t size;
   unsigned int *bits;
@@ -125,6 +246,8 @@ struct smal_buffer {
   size_t object_size; /** == type->object_size. */
   size_t object_alignment; /** == type->object_alignment. */
   size_t object_capacity; /** Number of objects that can be allocated from this buffer. */
+  unsigned long long object_size_recip; /** Multiplier of object offsets for division by object_size; see smal_buffer_ptr_i(). */
+  int object_size_shift; /** Shift of object offsets after multiplication by object_size_recip. */
 
   void *mmap_addr; /** The address of mmap() memory for this buffer. */
   size_t mmap_size; /** The size of mmap() memory for this buffer. */
@@ -140,14 +263,13 @@ struct smal_buffer {
   smal_bitmap mark_bits;
   smal_thread_rwlock mark_bits_lock;
 
-  smal_bitmap free_bits;
-  smal_thread_rwlock free_bits_lock;
+  smal_bitmap free_bits; /** Updated atomically. */
 
-  smal_bitmap grey_bits;
+  smal_bitmap grey_bits; /** Marked objects whose references are not yet marked, after a mark queue overflow. */
   smal_thread_rwlock grey_bits_lock;
+  int mark_overflow; /** If true, grey_bits has objects to rescan. */
 
-  void *free_list; /** Free list of previously allocated but currently unused objects. */
-  smal_thread_mutex free_list_mutex;
+  smal_free_list_head free_list; /** Lock-free free list of previously allocated but currently unused objects. */
 
   smal_thread_rwlock write_protect_lock;
   int write_protect;   /** If true, region between write_protect_addr and write_protect_addr + write_protect_size is protected against writes. */
@@ -157,9 +279,27 @@ struct smal_buffer {
   smal_thread_rwlock mutation_lock;
   int mutation_write_barrier; /** If true, use write barrier flag mutation if write protect region is modified. */
   int mutation; /** If true, elements within smal_buffer allocation space were mutated. */
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  int mutation_run; /** Consecutive collections with (> 0) or without (< 0) mutation while tracking; collections since it stopped otherwise. */
+  int write_barrier_backoff; /** log2 of the multiple of smal_write_barrier_adapt collections before tracking again. */
+  int write_barrier_adapted; /** 1 if tracking was stopped, -1 if started, 0 if neither. */
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  size_t slice_n; /** Number of OS pages in the mmap region, if slice_dirty. */
+  unsigned char *slice_dirty; /** If not 0, a byte per OS page of the mmap region, set when the page is mutated. */
+#endif
+
+#if SMAL_CARD_MARKING
+  unsigned char *cards; /** If not 0, a byte per smal_card_SIZE bytes of the mmap region, set by smal_write_barrier(). */
+  size_t cards_size;
+  size_t card_base; /** cards - (mmap_addr >> smal_card_SHIFT). */
+#endif
 
   int markable;  /** If true, this buffer should mark objects into it. */
   int sweepable; /** If true, this buffer is up for sweeping. */
+#if SMAL_GENERATIONAL
+  int young; /** If true, objects were allocated from this buffer since the last collection. */
+#endif
 
 #if SMAL_REMEMBERED_SET
   int use_remembered_set;
@@ -167,6 +307,12 @@ struct smal_buffer {
   struct smal_remembered_set *remembered_set;
   int remembered_set_valid;
 #endif
+
+#if SMAL_BUFFER_POOL
+  smal_buffer *retained_next; /** Next in type->retained. */
+  double retain_time; /** When this buffer was retained. */
+  int decommitted; /** If true, retained pages were returned to the OS. */
+#endif
 };
 
 extern int smal_debug_level;
@@ -177,15 +323,38 @@ smal_type *smal_type_for_desc(smal_type_descriptor *desc);
 smal_type *smal_type_for(size_t object_size, smal_mark_func mark_func, smal_free_func free_func); /** Deprecated. */
 void smal_type_free(smal_type *type);
 
-void smal_alloc_p(smal_type *type, void **ptrp); /** Thread-safe. */
+void smal_alloc_p(smal_type *type, void **ptrp); /** Thread-safe.  Uses a per-thread cache if SMAL_ALLOC_CACHE. */
 void *smal_alloc(smal_type *type); /** Not thread-safe: reference is returned in a register. */
+static inline void *smal_alloc_inline(smal_type *type); /** Inlined fast path of smal_alloc(). */
+size_t smal_alloc_n(smal_type *type, size_t n, void **ptrs); /** Thread-safe.  Allocates n objects into ptrs[], returns number allocated; the rest are 0. */
+void *smal_alloc_size(size_t size, smal_mark_func mark_func, smal_free_func free_func); /** Allocates from the smal_type for size's size class.  Returns 0 if size is too large.  Not thread-safe: see smal_alloc(). */
+void *smal_realloc(void *ptr, size_t size); /** Returns ptr if size is in the same size class, otherwise moves ptr's contents into a new object, frees ptr without calling free_func. */
 void smal_free(void *ptr); /** Thread-safe. */
 void smal_free_p(void **ptrp); /** Thread-safe. */
 
-/** Start a collection. */
+/** Start a collection.  Finishes an incremental collection, if one is in progress. */
 void smal_collect(); /* Thread-safe. */
 void smal_collect_wait_for_sweep(); /* Thread-safe. */
 
+#if SMAL_GENERATIONAL
+/** Collect objects allocated since the last collection; objects that survived it are kept.  Thread-safe. */
+void smal_collect_minor();
+#endif
+#if SMAL_INCREMENTAL
+/** Start an incremental collection; returns 0 if a collection is in progress or collections are disabled. */
+int smal_collect_start();
+/** Mark or sweep for about budget_ns nanoseconds, or until done if 0.  Returns 1 while the collection is in progress. */
+int smal_collect_step(unsigned long budget_ns);
+#endif
+#if SMAL_CONCURRENT_MARK
+/** Start a collection that marks in a background thread; returns 0 if it could not start.  Finish it with smal_collect_step() or smal_collect(). */
+int smal_collect_start_concurrent();
+#endif
+/** Store value into a pointer field of obj.  Required for stores of pointers into objects during an incremental or concurrent collection,
+    and into objects of desc.card_marking types.
+    obj must be a smal object: once a desc.card_marking type exists, its buffer is read from obj's page.  Asserted if SMAL_DEBUG. */
+static inline void smal_write_barrier(void *obj, void **field, void *value);
+
 /* Mark pointers. */
 /** Users can call these methods only during smal_collect(): */
 void smal_mark_ptr(void *referrer, void *ptr); 
@@ -193,7 +362,7 @@ void smal_mark_ptr_p(void *referrer, void **ptrp);
 void smal_mark_ptr_n(void *referrer, int n_ptrs, void **ptrs);
 
 /** Mark groups of possible pointers. */
-void smal_mark_ptr_range(void *referrer, void *ptr, void *ptr_end); /** Assumes arbitrary alignments of possible pointers within region. */
+void smal_mark_ptr_range(void *referrer, void *ptr, void *ptr_end); /** Assumes arbitrary alignments of possible pointers within region, unless SMAL_MARK_RANGE_ALIGNED. */
 void smal_mark_bindings(int n_bindings, void ***bindings);
 
 /** If func() returns < 0; stop iterating, returns < 0 if func() < 0. */
@@ -256,8 +425,67 @@ void smal_debug_set_level(smal_debug_t dt, int value);
 #define smal_page_size_default ((size_t) (4 * 4 * 1024))
 #endif
 
+/* Define SMAL_PAGE_SIZE_FIXED to compile in smal_page_size_default. */
+#ifndef SMAL_PAGE_SIZE_FIXED
+#define SMAL_PAGE_SIZE_FIXED 0
+#endif
+
+#if SMAL_PAGE_SIZE_FIXED
 #define smal_page_size smal_page_size_default
 #define smal_page_mask (smal_page_size - 1)
+#define smal_page_shift __builtin_ctzl(smal_page_size)
+#else
+/** The size and alignment of a smal_buffer: a power of 2, selected by smal_init(). */
+extern size_t smal_page_size;
+extern size_t smal_page_mask;
+extern int smal_page_shift;
+#endif
+
+/** Requested smal_page_size; read by smal_init().  If 0, uses $SMAL_PAGE_SIZE or smal_page_size_default. */
+extern size_t smal_page_size_init;
+/** If true and smal_page_size is a multiple of 2MiB, try MAP_HUGETLB before MADV_HUGEPAGE.  Also $SMAL_HUGETLB. */
+extern int smal_page_hugetlb;
+#if SMAL_ARENA
+/** Bytes of address space reserved at a time for smal_buffer pages.  If 0, each smal_buffer is mmap()ed. */
+extern size_t smal_arena_size;
+#endif
+
+#if SMAL_BUFFER_POOL
+/** Maximum bytes of empty buffers retained for reuse; 0 disables retention. */
+extern size_t smal_buffer_pool_max;
+/** Seconds before idle retained buffers are madvise()d away and unmapped; negative disables. */
+extern double smal_buffer_pool_decommit_secs, smal_buffer_pool_unmap_secs;
+void smal_buffer_pool_decay(); /** Decommit or free idle retained buffers.  Called after each smal_collect(). */
+#endif
+
+#if SMAL_MARK_QUEUE
+/** Maximum bytes of mark queue chunks, retained across collections.  If reached, objects are marked grey and rescanned.  0 is unlimited. */
+extern size_t smal_mark_queue_max;
+/** Number of objects marked grey because the mark queue was full. */
+extern size_t smal_mark_queue_overflow_n;
+#endif
+
+#if SMAL_SOFT_DIRTY
+/** If true, the buffer write barrier reads soft-dirty page bits rather than write-protecting buffers.
+    smal_init() sets it to 1 if the kernel tracks them, unless it is 0 or $SMAL_SOFT_DIRTY=0. */
+extern int smal_soft_dirty;
+#endif
+
+#if SMAL_GENERATIONAL
+/** If true, buffers of all types track mutation with the write barrier, so smal_collect_minor() scans only buffers written since the last collection.
+    Set by the first smal_collect_minor(); set before allocating to track from the start.  Also $SMAL_GENERATIONAL. */
+extern int smal_generational;
+#endif
+
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+/** Consecutive collections a buffer must be mutated before it stops tracking mutation; 0 disables adaptation.  Also $SMAL_WRITE_BARRIER_ADAPT. */
+extern int smal_write_barrier_adapt;
+#endif
+
+#if SMAL_PARALLEL_MARK
+/** Threads marking in parallel, including the collecting thread.  Defaults to 1, or $SMAL_MARK_THREADS. */
+extern int smal_mark_threads;
+#endif
 
 #ifndef smal_buffer_object_size
 #define smal_buffer_object_size(buf) (buf)->object_size
@@ -267,11 +495,114 @@ void smal_debug_set_level(smal_debug_t dt, int value);
 #define smal_buffer_object_alignment(buf) (buf)->object_alignment
 #endif
 
+/*********************************************************************
+ * Per-thread allocation caches.
+ * See src/alloc_cache.h.
+ */
+
+#ifndef smal_alloc_cache_TYPES
+#define smal_alloc_cache_TYPES 16
+#endif
+
+typedef struct smal_alloc_cache_entry {
+  smal_type *type;
+  smal_buffer *buffer; /** The buffer all cached objects were detached from. */
+  size_t object_size; /** == buffer->object_size. */
+  void *free_list; /** Objects detached from buffer->free_list. */
+  void *alloc_ptr, *end_ptr; /** Run of objects detached from buffer->alloc_ptr. */
+  size_t alloc_n; /** Objects handed out, not yet published to stats. */
+} smal_alloc_cache_entry;
+
+typedef struct smal_alloc_cache {
+  smal_thread_mutex mutex; /** Locked to refill, flush or publish entries. */
+  int owner_busy; /** The owning thread is allocating from an entry without the mutex. */
+  int flushing; /** The mutex holder is flushing or publishing entries. */
+  smal_alloc_cache_entry entries[smal_alloc_cache_TYPES];
+} smal_alloc_cache;
+
+#if SMAL_PTHREAD
+#define smal_alloc_cache_TLS __thread
+#else
+#define smal_alloc_cache_TLS
+#endif
+
+#if SMAL_ALLOC_CACHE
+extern smal_alloc_cache_TLS smal_alloc_cache *_smal_alloc_cache_self; /** The calling thread's cache, or 0. */
+#endif
+
+/* Assumes cache mutex is locked. */
+static inline
+void *smal_alloc_cache_entry_alloc(smal_alloc_cache_entry *e)
+{
+  void *ptr;
+  if ( (ptr = e->free_list) ) {
+    e->free_list = * (void**) ptr;
+  } else if ( e->alloc_ptr < e->end_ptr ) {
+    ptr = e->alloc_ptr;
+    e->alloc_ptr += e->object_size;
+  } else {
+    return 0;
+  }
+  ++ e->alloc_n;
+  return ptr;
+}
+
+/* Allocates from the owning thread's cache without locking its mutex.
+   Returns 0 if the entry is empty or another thread is flushing the cache.
+   owner_busy and flushing are a handshake: each is stored before the other is read. */
+static inline
+void *smal_alloc_cache_alloc_owner(smal_alloc_cache *cache, smal_type *type)
+{
+  smal_alloc_cache_entry *e = &cache->entries[type->type_id % smal_alloc_cache_TYPES];
+  void *ptr = 0;
+#if SMAL_PTHREAD
+  cache->owner_busy = 1;
+  __sync_synchronize();
+  if ( ! * (volatile int*) &cache->flushing && e->type == type )
+    ptr = smal_alloc_cache_entry_alloc(e);
+  __sync_lock_release(&cache->owner_busy);
+#else
+  if ( e->type == type )
+    ptr = smal_alloc_cache_entry_alloc(e);
+#endif
+  return ptr;
+}
+
+/* Pops the thread's cached free list or bumps its cached run.
+   Calls smal_alloc() only if the cache is empty or being flushed. */
+static inline
+void *smal_alloc_inline(smal_type *type)
+{
+#if SMAL_ALLOC_CACHE
+  smal_alloc_cache *cache = _smal_alloc_cache_self;
+  void *ptr = 0;
+  if ( cache )
+    ptr = smal_alloc_cache_alloc_owner(cache, type);
+  return ptr ? ptr : smal_alloc(type);
+#else
+  return smal_alloc(type);
+#endif
+}
+
+#if SMAL_INCREMENTAL
+extern int _smal_collect_marking; /** True while an incremental collection is marking. */
+void _smal_write_barrier(void *obj, void *value);
+#endif
+
+#if SMAL_CONCURRENT_MARK
+extern int _smal_collect_satb; /** True while a concurrent collection is marking. */
+void _smal_satb_log(void *old);
+#endif
+
+#if SMAL_CARD_MARKING
+extern int _smal_card_marking; /** True once a desc.card_marking type exists. */
+#endif
+
 /*********************************************************************
  * addr -> page mapping.
  */
 
-#define smal_addr_page_id(PTR) (((size_t) (PTR)) / smal_page_size)
+#define smal_addr_page_id(PTR) (((size_t) (PTR)) >> smal_page_shift)
 #define smal_addr_page_offset(PTR) (((size_t) (PTR)) & smal_page_mask)
 #define smal_addr_page(PTR) ((void*)(((size_t) (PTR)) & ~smal_page_mask))
 
@@ -313,6 +644,34 @@ struct smal_page {
 
 #endif
 
+/*********************************************************************
+ * Write barrier.
+ */
+
+static inline
+void smal_write_barrier(void *obj, void **field, void *value)
+{
+#if SMAL_CONCURRENT_MARK
+  void *old;
+  if ( __builtin_expect(_smal_collect_satb != 0, 0) && (old = *field) )
+    _smal_satb_log(old);
+#endif
+#if SMAL_DEBUG
+  assert(smal_buffer_from_ptr(obj));
+#endif
+  *field = value;
+#if SMAL_CARD_MARKING
+  if ( __builtin_expect(_smal_card_marking != 0, 0) ) {
+    size_t card_base = smal_addr_to_buffer(obj)->card_base;
+    if ( card_base )
+      * (unsigned char*) (card_base + ((size_t) field >> smal_card_SHIFT)) = 1;
+  }
+#endif
+#if SMAL_INCREMENTAL
+  if ( __builtin_expect(_smal_collect_marking != 0, 0) && value )
+    _smal_write_barrier(obj, value);
+#endif
+}
 
 #endif
 
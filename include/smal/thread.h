@@ -57,6 +57,11 @@ typedef struct smal_thread {
     ucontext_t _ucontext;
   } registers;
   void *user_data[4];
+  void *alloc_cache; /** Per-thread smal_type allocation caches, see src/alloc_cache.h. */
+  void *satb_log; /** Old values logged by smal_write_barrier(), see src/concurrent_mark.h. */
+  int satb_busy; /** True while this thread appends to satb_log. */
+  size_t id; /** Sequence number of this thread. */
+  size_t epoch; /** Global epoch when this thread entered a lock-free read; 0 if none. */
 } smal_thread;
 
 #if SMAL_PTHREAD
@@ -73,7 +78,12 @@ int smal_thread_do_once(smal_thread_once *once, void (*init_routine)());
 
 void smal_thread_init(); // ???
 smal_thread *smal_thread_self();
+#if ! SMAL_PTHREAD
+extern smal_thread _smal_thread_main;
+#define smal_thread_self() (&_smal_thread_main)
+#endif
 void smal_thread_died(smal_thread *t); //
+extern void (*smal_thread_exit_hook)(smal_thread *t); /** Called when a thread exits. */
 int smal_thread_getstack(smal_thread *t, void **addrp, size_t *sizep);
 int smal_thread_each(int (*func)(smal_thread *t, void *arg), void *arg);
 void *smal_thread_join(smal_thread *t);
@@ -0,0 +1,268 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Per-thread allocation caches.
+
+  Each smal_thread has a small direct-mapped table of entries indexed by smal_type type_id,
+  see smal_alloc_cache in smal.h.
+  An entry holds a batch of objects detached from a single smal_buffer by smal_buffer_alloc_objects().
+  The owning thread finds its cache through _smal_alloc_cache_self and allocates from an entry
+  without locking: see smal_alloc_cache_alloc_owner().  Another thread flushing or publishing
+  the entries, during a collection, smal_each_object() or a stats query, locks the cache mutex,
+  sets flushing and waits for the owner to leave its allocation; the owner then falls back to
+  the locked refill path until flushing is cleared.
+
+  alloc_id and live_n for objects handed out from an entry are published to stats lazily.
+
+  An exiting thread flushes its cache under alloc_lock, like a refill, then frees it.
+  alloc_cache_lock keeps it from being freed while other threads flush or publish it.
+*/
+
+#ifndef smal_alloc_cache_SIZE
+#define smal_alloc_cache_SIZE 64
+#endif
+
+static smal_thread_rwlock alloc_cache_lock;
+
+smal_alloc_cache_TLS smal_alloc_cache *_smal_alloc_cache_self;
+
+static
+smal_alloc_cache *smal_alloc_cache_new(smal_thread *thr)
+{
+  smal_alloc_cache *cache = malloc(sizeof(*cache));
+  malloc_overhead_size += sizeof(*cache);
+  memset(cache, 0, sizeof(*cache));
+  smal_thread_mutex_init(&cache->mutex);
+  thr->alloc_cache = _smal_alloc_cache_self = cache;
+  return cache;
+}
+
+/* Assumes cache mutex is locked.  Waits for the owning thread to leave smal_alloc_cache_alloc_owner(). */
+static inline
+void smal_alloc_cache_exclude_owner(smal_alloc_cache *cache)
+{
+#if SMAL_PTHREAD
+  cache->flushing = 1;
+  __sync_synchronize();
+  while ( * (volatile int*) &cache->owner_busy )
+    ;
+#endif
+}
+
+static inline
+void smal_alloc_cache_release_owner(smal_alloc_cache *cache)
+{
+#if SMAL_PTHREAD
+  __sync_lock_release(&cache->flushing);
+#endif
+}
+
+/* Assumes cache mutex is locked. */
+static
+void smal_alloc_cache_entry_publish(smal_alloc_cache_entry *e)
+{
+  if ( e->alloc_n ) {
+    smal_buffer_alloc_objects_publish(e->buffer, e->alloc_n);
+    e->alloc_n = 0;
+  }
+}
+
+/* Return unused objects to their buffer.  Assumes cache mutex is locked. */
+static
+void smal_alloc_cache_entry_flush(smal_alloc_cache_entry *e)
+{
+  smal_buffer *self = e->buffer;
+  size_t free_n = 0, unalloc_n = 0;
+  void *ptr;
+
+  if ( ! self ) return;
+
+  smal_alloc_cache_entry_publish(e);
+
+  /* Give back the remaining run by rewinding alloc_ptr, if nothing was allocated after it. */
+  if ( e->alloc_ptr < e->end_ptr ) {
+    smal_thread_mutex_lock(&self->alloc_ptr_mutex);
+    if ( self->alloc_ptr == e->end_ptr ) {
+      unalloc_n = (e->end_ptr - e->alloc_ptr) / smal_buffer_object_size(self);
+#if SMAL_GENERATIONAL
+      /* Mark bits are sticky: a refill during a collection marked the whole run. */
+      for ( ptr = e->alloc_ptr; ptr < e->end_ptr; ptr += smal_buffer_object_size(self) )
+	smal_bitmap_clr_atomic(&self->mark_bits, smal_buffer_ptr_i(self, ptr));
+#endif
+      self->alloc_ptr = e->alloc_ptr;
+      e->alloc_ptr = e->end_ptr;
+    }
+    smal_thread_mutex_unlock(&self->alloc_ptr_mutex);
+  }
+
+  /* Otherwise, put the run and detached free_list back onto the buffer's free_list. */
+  if ( e->free_list || e->alloc_ptr < e->end_ptr ) {
+    void *first = 0, *last = 0;
+    while ( (ptr = smal_alloc_cache_entry_alloc(e)) ) {
+#if SMAL_GENERATIONAL
+      smal_bitmap_clr_atomic(&self->mark_bits, smal_buffer_ptr_i(self, ptr));
+#endif
+      smal_buffer_free_set(self, ptr);
+      * (void**) ptr = first;
+      first = ptr;
+      if ( ! last )
+	last = ptr;
+      ++ free_n;
+    }
+    smal_free_list_push_n(self, first, last);
+  }
+
+  if ( free_n + unalloc_n ) {
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(free_n, += free_n);
+    smal_UPDATE_STATS(alloc_n, -= unalloc_n);
+    smal_UPDATE_STATS(avail_n, += free_n + unalloc_n);
+    smal_LOCK_STATS(unlock);
+  }
+
+  memset(e, 0, sizeof(*e));
+}
+
+static
+int smal_alloc_cache_flush_thread(smal_thread *thr, void *arg)
+{
+  smal_alloc_cache *cache = thr->alloc_cache;
+  int i;
+  if ( cache ) {
+    smal_thread_mutex_lock(&cache->mutex);
+    smal_alloc_cache_exclude_owner(cache);
+    for ( i = 0; i < smal_alloc_cache_TYPES; ++ i ) {
+      if ( arg )
+	smal_alloc_cache_entry_publish(&cache->entries[i]);
+      else
+	smal_alloc_cache_entry_flush(&cache->entries[i]);
+    }
+    smal_alloc_cache_release_owner(cache);
+    smal_thread_mutex_unlock(&cache->mutex);
+  }
+  return 0;
+}
+
+/* Return all cached objects to their buffers. */
+static
+void smal_alloc_cache_flush_all()
+{
+  smal_thread_rwlock_rdlock(&alloc_cache_lock);
+  smal_thread_each(smal_alloc_cache_flush_thread, 0);
+  smal_thread_rwlock_unlock(&alloc_cache_lock);
+}
+
+/* Publish pending stats of all caches. */
+static
+void smal_alloc_cache_publish_all()
+{
+  smal_thread_rwlock_rdlock(&alloc_cache_lock);
+  smal_thread_each(smal_alloc_cache_flush_thread, (void*) 1);
+  smal_thread_rwlock_unlock(&alloc_cache_lock);
+}
+
+static
+void smal_alloc_cache_free_all_thread(smal_thread *thr)
+{
+  smal_alloc_cache *cache;
+  if ( (cache = thr->alloc_cache) ) {
+    thr->alloc_cache = 0;
+    if ( _smal_alloc_cache_self == cache )
+      _smal_alloc_cache_self = 0;
+    smal_thread_mutex_destroy(&cache->mutex);
+    free(cache);
+    malloc_overhead_size -= sizeof(*cache);
+  }
+}
+
+static
+int _smal_alloc_cache_free_all(smal_thread *thr, void *arg)
+{
+  smal_alloc_cache_free_all_thread(thr);
+  return 0;
+}
+
+static
+void smal_alloc_cache_free_all()
+{
+  smal_thread_each(_smal_alloc_cache_free_all, 0);
+}
+
+/* smal_thread_exit_hook: give back objects cached by an exiting thread and free its cache. */
+static
+void smal_alloc_cache_thread_exit(smal_thread *thr)
+{
+  if ( ! (initialized && thr->alloc_cache) )
+    return;
+
+  /* Pause smal_collect (writer) */
+  smal_thread_rwlock_rdlock(&alloc_lock);
+  smal_alloc_cache_flush_thread(thr, 0);
+  smal_thread_rwlock_unlock(&alloc_lock);
+
+  smal_thread_rwlock_wrlock(&alloc_cache_lock);
+  smal_alloc_cache_free_all_thread(thr);
+  smal_thread_rwlock_unlock(&alloc_cache_lock);
+}
+
+static
+void *smal_alloc_cache_refill(smal_alloc_cache *cache, smal_alloc_cache_entry *e, smal_type *type)
+{
+  smal_buffer *buf;
+  void *free_list = 0, *run_ptr = 0;
+  size_t n = 0;
+  void *ptr = 0;
+
+  smal_thread_rwlock_rdlock(&alloc_lock);
+
+  smal_thread_mutex_lock(&type->alloc_buffer_mutex);
+  if ( smal_likely((buf = smal_type_alloc_buffer(type))) ) {
+    /* If current smal_buffer cannot provide, try a new smal_buffer. */
+    if ( smal_unlikely(! (n = smal_buffer_alloc_objects(buf, smal_alloc_cache_SIZE, &free_list, &run_ptr))) ) {
+      type->alloc_buffer = 0;
+      if ( smal_likely((buf = smal_type_alloc_buffer(type))) )
+	n = smal_buffer_alloc_objects(buf, smal_alloc_cache_SIZE, &free_list, &run_ptr);
+    }
+  }
+  smal_thread_mutex_unlock(&type->alloc_buffer_mutex);
+
+  if ( smal_likely(n) ) {
+    smal_thread_mutex_lock(&cache->mutex);
+    /* Evict another type or publish stats for the previous buffer. */
+    smal_alloc_cache_entry_flush(e);
+    e->type = type;
+    e->buffer = buf;
+    e->object_size = smal_buffer_object_size(buf);
+    e->free_list = free_list;
+    if ( run_ptr ) {
+      e->alloc_ptr = run_ptr;
+      e->end_ptr = run_ptr + n * smal_buffer_object_size(buf);
+    }
+    ptr = smal_alloc_cache_entry_alloc(e);
+    smal_thread_mutex_unlock(&cache->mutex);
+  }
+
+  smal_thread_rwlock_unlock(&alloc_lock);
+
+  return ptr;
+}
+
+static inline
+void *smal_alloc_cache_alloc(smal_type *type)
+{
+  smal_alloc_cache *cache = _smal_alloc_cache_self;
+  void *ptr;
+
+  if ( smal_unlikely(! cache) )
+    cache = smal_alloc_cache_new(smal_thread_self());
+
+  if ( smal_unlikely(! (ptr = smal_alloc_cache_alloc_owner(cache, type))) )
+    ptr = smal_alloc_cache_refill(cache, &cache->entries[type->type_id % smal_alloc_cache_TYPES], type);
+
+  return ptr;
+}
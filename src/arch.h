@@ -25,4 +25,22 @@ void smal_ia64_flushrs(void);
 #  define smal_FLUSH_REGISTER_WINDOWS ((void)0)
 #endif
 
+/*
+  Caller-saved registers hold no live values across a call to smal_collect(),
+  but may hold stale pointers that would retain garbage if scanned.
+*/
+#if defined(__linux__) && defined(__x86_64__) && defined(REG_R8)
+#include <string.h> /* memset() */
+#  define smal_CLEAR_CALLER_SAVED_REGISTERS(UC)				\
+  do {									\
+    greg_t *_g = (UC)->uc_mcontext.gregs;				\
+    _g[REG_RAX] = _g[REG_RCX] = _g[REG_RDX] = _g[REG_RSI] = _g[REG_RDI] = 0; \
+    _g[REG_R8] = _g[REG_R9] = _g[REG_R10] = _g[REG_R11] = 0;		\
+    if ( (UC)->uc_mcontext.fpregs )					\
+      memset((UC)->uc_mcontext.fpregs->_xmm, 0, sizeof((UC)->uc_mcontext.fpregs->_xmm)); \
+  } while ( 0 )
+#else
+#  define smal_CLEAR_CALLER_SAVED_REGISTERS(UC) ((void)0)
+#endif
+
 #endif
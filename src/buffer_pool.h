@@ -0,0 +1,216 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Retained pools of empty smal_buffers.
+
+  A buffer swept with no live objects is detached and pushed onto its smal_type's
+  retained list instead of being freed, up to smal_buffer_pool_max bytes in total.
+  smal_type_alloc_buffer() takes a retained buffer before mapping a new one:
+  its memory, bitmaps and mutexes are reused, so no system calls or malloc()s are needed.
+
+  smal_buffer_pool_decay(), run after each collection, returns retained buffers idle for
+  smal_buffer_pool_decommit_secs to the OS with madvise(), keeping their address space,
+  then frees those idle for smal_buffer_pool_unmap_secs.  A negative interval disables that step.
+
+  The retained list is protected by the type's alloc_buffer_mutex.
+*/
+
+#include <time.h> /* clock_gettime() */
+
+#ifndef smal_buffer_pool_max_default
+#define smal_buffer_pool_max_default ((size_t) 32 * 1024 * 1024)
+#endif
+
+size_t smal_buffer_pool_max = smal_buffer_pool_max_default;
+double smal_buffer_pool_decommit_secs = 1;
+double smal_buffer_pool_unmap_secs = 10;
+
+static size_t buffer_pool_size; /** Bytes retained by all types. */
+
+static inline
+double smal_buffer_pool_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Objects are in the first OS page only if the smal_buffer header is not. */
+static inline
+void *smal_buffer_pool_decommit_addr(smal_buffer *self)
+{
+  size_t os_page_mask = getpagesize() - 1;
+  return (void*) (((size_t) self->begin_ptr + os_page_mask) & ~ os_page_mask);
+}
+
+/* Return the object pages of a retained buffer to the OS. */
+static
+void smal_buffer_pool_decommit(smal_buffer *self)
+{
+  void *addr = smal_buffer_pool_decommit_addr(self);
+  void *end = self->mmap_addr + self->mmap_size;
+
+  if ( addr < end ) {
+#if defined(MADV_FREE)
+    madvise(addr, end - addr, MADV_FREE);
+#elif defined(MADV_DONTNEED)
+    madvise(addr, end - addr, MADV_DONTNEED);
+#endif
+  }
+  self->decommitted = 1;
+
+  smal_LOCK_STATS(lock);
+  smal_UPDATE_STATS(decommitted_size, += self->mmap_size);
+  smal_LOCK_STATS(unlock);
+}
+
+/* Assumes buffer is retained and its type's alloc_buffer_mutex is locked. */
+static
+void smal_buffer_pool_remove(smal_buffer *self)
+{
+  smal_LOCK_STATS(lock);
+  smal_UPDATE_STATS(retained_size, -= self->mmap_size);
+  if ( self->decommitted )
+    smal_UPDATE_STATS(decommitted_size, -= self->mmap_size);
+  smal_LOCK_STATS(unlock);
+  self->decommitted = 0;
+  __sync_sub_and_fetch(&buffer_pool_size, self->mmap_size);
+}
+
+/* Detach an empty buffer and retain it for reuse; otherwise free it. */
+static
+void smal_buffer_pool_retain(smal_buffer *self)
+{
+  smal_type *type = self->type;
+
+  if ( smal_unlikely(__sync_add_and_fetch(&buffer_pool_size, self->mmap_size) > smal_buffer_pool_max) ) {
+    __sync_sub_and_fetch(&buffer_pool_size, self->mmap_size);
+    smal_buffer_free(self);
+    return;
+  }
+
+  smal_buffer_detach(self);
+#if SMAL_REMEMBERED_SET
+  self->remembered_set = 0;
+  self->remembered_set_valid = self->record_remembered_set = 0;
+#endif
+  /* Allocations were paused by smal_buffer_before_mark(). */
+  smal_buffer_resume_allocations(self);
+  self->retain_time = smal_buffer_pool_now();
+
+  smal_LOCK_STATS(lock);
+  smal_UPDATE_STATS(retained_size, += self->mmap_size);
+  smal_LOCK_STATS(unlock);
+
+  smal_thread_mutex_lock(&type->alloc_buffer_mutex);
+  self->retained_next = type->retained;
+  type->retained = self;
+  smal_thread_mutex_unlock(&type->alloc_buffer_mutex);
+}
+
+/* Reset a retained buffer to its state after smal_buffer_alloc(). */
+static
+void smal_buffer_pool_reuse(smal_buffer *self)
+{
+  smal_type *type = self->type;
+
+  smal_debug(buffer, 1, "(@%p)", self);
+
+  smal_bitmap_clr_all(&self->mark_bits);
+  smal_bitmap_clr_all(&self->free_bits);
+  smal_bitmap_clr_all(&self->grey_bits);
+#if SMAL_CARD_MARKING
+  if ( self->cards )
+    memset(self->cards, 0, self->cards_size);
+#endif
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  smal_buffer_adapt_reset(self);
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( self->slice_dirty )
+    memset(self->slice_dirty, 0, self->slice_n);
+#endif
+  self->free_list = 0;
+  self->alloc_ptr = self->begin_ptr;
+  self->markable = self->sweepable = 0;
+  self->mutation = 0;
+  memset(&self->stats, 0, offsetof(smal_stats, _mutex));
+  self->type_buffer_list.buffer = self;
+
+  smal_buffer_table_add(self);
+
+  smal_thread_rwlock_wrlock(&type->buffers_lock);
+  smal_dllist_init(&self->type_buffer_list);
+  smal_dllist_insert(&type->buffers, &self->type_buffer_list);
+  smal_thread_rwlock_unlock(&type->buffers_lock);
+
+  smal_LOCK_STATS(lock);
+  smal_UPDATE_STATS(capacity_n, += self->object_capacity);
+  smal_UPDATE_STATS(avail_n,    += self->object_capacity);
+  smal_UPDATE_STATS(buffer_id,  += 1);
+  self->buffer_id = self->stats.buffer_id = __sync_add_and_fetch(&buffer_head.buffer_id, 1);
+  smal_UPDATE_STATS(buffer_n,   += 1);
+  smal_UPDATE_STATS(mmap_size,  += self->mmap_size);
+  smal_UPDATE_STATS(mmap_total, += self->mmap_size);
+  smal_LOCK_STATS(unlock);
+}
+
+/* Returns a retained buffer ready for allocation, or 0.  Assumes alloc_buffer_mutex is locked. */
+static
+smal_buffer *smal_buffer_pool_take(smal_type *type)
+{
+  smal_buffer *self;
+  if ( (self = type->retained) ) {
+    type->retained = self->retained_next;
+    self->retained_next = 0;
+    smal_buffer_pool_remove(self);
+    smal_buffer_pool_reuse(self);
+  }
+  return self;
+}
+
+/* Free every retained buffer of type. */
+static
+void smal_buffer_pool_free_type(smal_type *type)
+{
+  smal_buffer *self;
+  smal_thread_mutex_lock(&type->alloc_buffer_mutex);
+  while ( (self = type->retained) ) {
+    type->retained = self->retained_next;
+    smal_buffer_pool_remove(self);
+    smal_buffer_release(self);
+  }
+  smal_thread_mutex_unlock(&type->alloc_buffer_mutex);
+}
+
+void smal_buffer_pool_decay()
+{
+  double now = smal_buffer_pool_now();
+  smal_type *type;
+
+  smal_thread_mutex_lock(&type_head_mutex);
+  smal_dllist_each(&type_head, type); {
+    smal_buffer **bp, *self;
+    smal_thread_mutex_lock(&type->alloc_buffer_mutex);
+    for ( bp = &type->retained; (self = *bp); ) {
+      double idle = now - self->retain_time;
+      if ( smal_buffer_pool_unmap_secs >= 0 && idle >= smal_buffer_pool_unmap_secs ) {
+	*bp = self->retained_next;
+	smal_buffer_pool_remove(self);
+	smal_buffer_release(self);
+	continue;
+      }
+      if ( ! self->decommitted && smal_buffer_pool_decommit_secs >= 0 && idle >= smal_buffer_pool_decommit_secs )
+	smal_buffer_pool_decommit(self);
+      bp = &self->retained_next;
+    }
+    smal_thread_mutex_unlock(&type->alloc_buffer_mutex);
+  } smal_dllist_each_end();
+  smal_thread_mutex_unlock(&type_head_mutex);
+}
+
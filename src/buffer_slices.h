@@ -0,0 +1,120 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Write barrier slices: remembered sets and rescanning.
+
+  Each slice of a buffer with a remembered set has its own, holding the references
+  of the objects starting in the slice.  A dirty slice invalidates the remembered sets
+  of all objects on it: an object starting in an earlier slice may extend into it.
+
+  If only some remembered sets are invalid and the buffer would not otherwise be marked,
+  smal_buffer_before_mark() greys the allocated objects starting in the invalid slices:
+  smal_mark_queue_rescan() scans only those, recording their references.
+  The other slices' remembered sets are marked as before.
+
+  A minor collection greys only the old objects on dirty slices, see generational.h.
+*/
+
+static
+void smal_buffer_slices_init(smal_buffer *self)
+{
+  self->slice_n = self->mmap_size >> smal_slice_shift;
+  if ( ! (self->slice_dirty = malloc(self->slice_n)) )
+    abort();
+  malloc_overhead_size += self->slice_n;
+  memset(self->slice_dirty, 0, self->slice_n);
+}
+
+static
+void smal_buffer_slices_free(smal_buffer *self)
+{
+  if ( self->slice_dirty ) {
+    free(self->slice_dirty);
+    malloc_overhead_size -= self->slice_n;
+    self->slice_dirty = 0;
+  }
+}
+
+/* The objects overlapping slice s are [*ip, *i_endp); returns 0 if there are none. */
+static inline
+int smal_buffer_slice_objects(smal_buffer *self, size_t s, size_t *ip, size_t *i_endp)
+{
+  void *slice = smal_buffer_slice_addr(self, s);
+  void *slice_end = slice + smal_slice_size;
+  void *alloc_ptr = smal_buffer_alloc_ptr(self);
+
+  if ( slice_end <= self->begin_ptr || slice >= alloc_ptr )
+    return 0;
+  *ip = slice > self->begin_ptr ? smal_buffer_ptr_i(self, slice) : 0;
+  *i_endp = slice_end < alloc_ptr ? smal_buffer_ptr_i(self, slice_end - 1) + 1 : smal_buffer_ptr_i(self, alloc_ptr - 1) + 1;
+  return 1;
+}
+
+/* Grey the objects [i, i_end) that are allocated; if old, only those that are marked. */
+static
+void smal_buffer_grey_objects(smal_buffer *self, size_t i, size_t i_end, int old)
+{
+  for ( ; i < i_end; ++ i ) {
+    if ( smal_bitmap_setQ(&self->free_bits, i) )
+      continue;
+    if ( ! smal_bitmap_setQ(&self->mark_bits, i) ) {
+      if ( old )
+	continue;
+      smal_bitmap_set(&self->mark_bits, i);
+    }
+    smal_bitmap_set(&self->grey_bits, i);
+    self->mark_overflow = mark_queue_overflow = 1;
+  }
+}
+
+#if SMAL_GENERATIONAL
+/* Grey the old objects overlapping dirty slices. */
+static
+void smal_buffer_slices_grey_dirty(smal_buffer *self)
+{
+  size_t s, i, i_end;
+  for ( s = 0; s < self->slice_n; ++ s ) {
+    if ( self->slice_dirty[s] && smal_buffer_slice_objects(self, s, &i, &i_end) )
+      smal_buffer_grey_objects(self, i, i_end, 1);
+  }
+}
+#endif
+
+/* Invalidate the remembered sets of the objects on dirty slices. */
+static
+void smal_buffer_slices_invalidate(smal_buffer *self)
+{
+  size_t s, i, i_end, s_begin;
+  for ( s = 0; s < self->slice_n; ++ s ) {
+    if ( ! (self->slice_dirty[s] && smal_buffer_slice_objects(self, s, &i, &i_end)) )
+      continue;
+    /* The first object may start in an earlier slice. */
+    s_begin = smal_buffer_slice_i(self, smal_buffer_i_ptr(self, i));
+    for ( ; s_begin <= s; ++ s_begin ) {
+      if ( self->remembered_set[s_begin].valid ) {
+	self->remembered_set[s_begin].valid = 0;
+	self->remembered_set_valid = 0;
+      }
+    }
+  }
+}
+
+/* Grey the objects starting in slices with recording remembered sets; if old, only those that are marked. */
+static
+void smal_buffer_slices_grey_recording(smal_buffer *self, int old)
+{
+  size_t s, i, i_end;
+  for ( s = 0; s < self->slice_n; ++ s ) {
+    if ( ! (self->remembered_set[s].record && smal_buffer_slice_objects(self, s, &i, &i_end)) )
+      continue;
+    /* Skip an object starting in the previous slice. */
+    if ( smal_buffer_i_ptr(self, i) < smal_buffer_slice_addr(self, s) )
+      ++ i;
+    smal_buffer_grey_objects(self, i, i_end, old);
+  }
+}
@@ -1,3 +1,29 @@
+#if SMAL_WRITE_BARRIER_SLICES
+/*
+  Write barrier slices.
+
+  A buffer under the write barrier tracks mutation per OS page of its mmap region: a slice.
+  A fault marks its slice dirty and unprotects only that slice; the other slices stay protected.
+  The remembered set of a buffer is kept per slice, see remembered_set.h and buffer_slices.h:
+  a dirty slice invalidates only the remembered sets of the objects on it.
+*/
+
+static size_t smal_slice_size;
+static int smal_slice_shift;
+
+#define smal_buffer_slice_i(BUF, PTR) \
+  ((size_t) ((void*) (PTR) - smal_buffer_to_page(BUF)) >> smal_slice_shift)
+#define smal_buffer_slice_addr(BUF, S) \
+  (smal_buffer_to_page(BUF) + ((S) << smal_slice_shift))
+#endif
+
+#if SMAL_SOFT_DIRTY
+#include "buffer_write_barrier_soft_dirty.h"
+#else
+#define smal_soft_dirty 0
+#define smal_buffer_update_mutation(BUF) ((void) 0)
+#endif
+
 #ifdef __APPLE__
 #define exn_init smal_buffer_write_barrier_init_os
 static void exn_init();
@@ -10,6 +36,13 @@ static inline
 void smal_buffer_write_barrier_init()
 {
   smal_buffer_write_barrier_init_os();
+#if SMAL_WRITE_BARRIER_SLICES
+  smal_slice_size = getpagesize();
+  smal_slice_shift = __builtin_ctzl(smal_slice_size);
+#endif
+#if SMAL_SOFT_DIRTY
+  smal_soft_dirty_init();
+#endif
 }
 
 static inline
@@ -70,11 +103,47 @@ static inline
 void smal_buffer_write_unprotect(smal_buffer *self)
 {
   smal_thread_rwlock_wrlock(&self->write_protect_lock);
-  if ( self->write_protect )
+  /* Some slices may still be protected. */
+  if ( self->write_protect_size )
     smal_buffer_write_unprotect_force(self);
   smal_thread_rwlock_unlock(&self->write_protect_lock);
 }
 
+#if SMAL_WRITE_BARRIER_SLICES
+/* Mark slice s dirty and unprotect it.
+   write_protect is cleared: the region is no longer entirely protected. */
+static
+void smal_buffer_slice_mutation(smal_buffer *self, size_t s, int count)
+{
+  smal_thread_rwlock_wrlock(&self->write_protect_lock);
+  if ( ! self->slice_dirty[s] ) {
+    self->slice_dirty[s] = 1;
+    if ( count ) {
+      smal_LOCK_STATS(lock);
+      smal_UPDATE_STATS(slice_mutations, += 1);
+      smal_LOCK_STATS(unlock);
+    }
+  }
+  if ( self->write_protect_size ) {
+    smal_mprotect(self, smal_buffer_slice_addr(self, s), smal_slice_size, PROT_READ | PROT_WRITE);
+    self->write_protect = 0;
+  }
+  smal_thread_rwlock_unlock(&self->write_protect_lock);
+}
+
+/* Mark the slices of [ptr, ptr + size) dirty. */
+static inline
+void smal_buffer_slices_mutation(smal_buffer *self, void *ptr, size_t size)
+{
+  size_t s = smal_buffer_slice_i(self, ptr);
+  size_t s_end = smal_buffer_slice_i(self, ptr + size - 1) + 1;
+  for ( ; s < s_end; ++ s ) {
+    if ( ! self->slice_dirty[s] )
+      smal_buffer_slice_mutation(self, s, 0);
+  }
+}
+#endif
+
 static inline
 int smal_write_barrier_mutation(void *addr, int code)
 {
@@ -96,6 +165,12 @@ int smal_write_barrier_mutation(void *addr, int code)
       }
       smal_thread_rwlock_unlock(&self->mutation_lock);
       /* Allow mutator to continue unabated. */
+#if SMAL_WRITE_BARRIER_SLICES
+      if ( self->slice_dirty ) {
+	smal_buffer_slice_mutation(self, smal_buffer_slice_i(self, addr), 1);
+	return 1; /* OK */
+      }
+#endif
       smal_buffer_write_unprotect(self);
       return 1; /* OK */
     }
@@ -115,17 +190,58 @@ void smal_buffer_clear_mutation(smal_buffer *self)
 {
   smal_thread_rwlock_wrlock(&self->mutation_lock);
   self->mutation = 0;
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( self->slice_dirty )
+    memset(self->slice_dirty, 0, self->slice_n);
+#endif
   smal_thread_rwlock_unlock(&self->mutation_lock);
-  if ( self->mutation_write_barrier ) 
+  if ( self->mutation_write_barrier && ! smal_soft_dirty ) 
     smal_buffer_write_protect(self);
 }
 
+/* After sweep unprotected the buffer:
+   protect it again, except the slices mutated since smal_buffer_before_mark(). */
 static inline
-void smal_buffer_assume_mutation(smal_buffer *self)
+void smal_buffer_write_reprotect(smal_buffer *self)
+{
+  if ( ! self->mutation_write_barrier || smal_soft_dirty )
+    return;
+  smal_thread_rwlock_rdlock(&self->mutation_lock);
+  if ( ! self->mutation ) {
+    smal_thread_rwlock_unlock(&self->mutation_lock);
+    smal_buffer_write_protect(self);
+    return;
+  }
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( self->slice_dirty ) {
+    size_t s;
+    smal_thread_rwlock_wrlock(&self->write_protect_lock);
+    for ( s = 0; s < self->slice_n; ++ s ) {
+      if ( ! self->slice_dirty[s] )
+	smal_mprotect(self, smal_buffer_slice_addr(self, s), smal_slice_size, PROT_READ);
+    }
+    self->write_protect = 0;
+    self->write_protect_addr = smal_buffer_to_page(self);
+    self->write_protect_size = smal_page_size;
+    smal_thread_rwlock_unlock(&self->write_protect_lock);
+  }
+#endif
+  smal_thread_rwlock_unlock(&self->mutation_lock);
+}
+
+/* The objects in [ptr, ptr + size) are about to be mutated. */
+static inline
+void smal_buffer_assume_mutation(smal_buffer *self, void *ptr, size_t size)
 {
   smal_thread_rwlock_wrlock(&self->mutation_lock);
   self->mutation = 1;
   smal_thread_rwlock_unlock(&self->mutation_lock);
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( self->slice_dirty ) {
+    smal_buffer_slices_mutation(self, ptr, size);
+    return;
+  }
+#endif
   if ( self->mutation_write_barrier ) 
     smal_buffer_write_unprotect(self);
 }
@@ -0,0 +1,155 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Linux soft-dirty page tracking.
+
+  The kernel sets the soft-dirty bit of a page on its first write after
+  "4" is written to /proc/self/clear_refs; /proc/self/pagemap reports it as bit 55.
+  Buffers are not write-protected and the mutator never faults:
+  smal_buffer_update_mutation() reads the bits of a buffer's pages before marking, with one pread(),
+  and splits them per slice if SMAL_WRITE_BARRIER_SLICES;
+  smal_soft_dirty_clear() resets the bits of all pages once per collection, right after
+  every buffer's bits were read and before allocation resumes, so no mutation falls between the two.
+  Writes by sweep are seen as mutations by the next collection.
+
+  clear_refs is process-wide: it also resets the bits of pages not owned by smal.
+*/
+
+#include <fcntl.h> /* open() */
+#include <stdint.h> /* uint64_t */
+
+#define smal_pagemap_SOFT_DIRTY (1ULL << 55)
+
+int smal_soft_dirty = -1;
+
+static int soft_dirty_clear_refs_fd = -1, soft_dirty_pagemap_fd = -1;
+
+/* Scratch pagemap entries; read only by the collector, under alloc_lock. */
+static uint64_t *soft_dirty_entries;
+static size_t soft_dirty_entries_n;
+
+/* Reads the pagemap entries of the n os pages at addr into soft_dirty_entries with one pread(); returns 0 on error. */
+static
+int smal_soft_dirty_read(void *addr, size_t n)
+{
+  size_t os_page_size = getpagesize();
+  off_t offset = ((size_t) addr / os_page_size) * sizeof(soft_dirty_entries[0]);
+
+  if ( n > soft_dirty_entries_n ) {
+    uint64_t *entries = realloc(soft_dirty_entries, n * sizeof(entries[0]));
+    if ( ! entries )
+      abort();
+    malloc_overhead_size += (n - soft_dirty_entries_n) * sizeof(entries[0]);
+    soft_dirty_entries = entries;
+    soft_dirty_entries_n = n;
+  }
+  return pread(soft_dirty_pagemap_fd, soft_dirty_entries, n * sizeof(soft_dirty_entries[0]), offset) == n * sizeof(soft_dirty_entries[0]);
+}
+
+/* Returns the soft-dirty bits of the os pages in [addr, addr + size), or'ed together. */
+static
+uint64_t smal_soft_dirty_bits(void *addr, size_t size)
+{
+  uint64_t bits = 0;
+  size_t n = size / getpagesize(), i;
+
+  if ( ! smal_soft_dirty_read(addr, n) )
+    return smal_pagemap_SOFT_DIRTY; /* Assume mutation. */
+  for ( i = 0; i < n; ++ i )
+    bits |= soft_dirty_entries[i];
+  return bits & smal_pagemap_SOFT_DIRTY;
+}
+
+static
+void smal_soft_dirty_clear()
+{
+  if ( write(soft_dirty_clear_refs_fd, "4", 1) != 1 )
+    abort();
+}
+
+/* Returns 1 if the kernel tracks soft-dirty bits. */
+static
+int smal_soft_dirty_probe()
+{
+  size_t os_page_size = getpagesize();
+  volatile char *page;
+  int ok = 0;
+
+  if ( (soft_dirty_clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY)) < 0 ||
+       (soft_dirty_pagemap_fd = open("/proc/self/pagemap", O_RDONLY)) < 0 )
+    goto done;
+
+  page = mmap(0, os_page_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+  if ( page == MAP_FAILED )
+    goto done;
+  page[0] = 1;
+  if ( smal_soft_dirty_bits((void*) page, os_page_size) &&
+       write(soft_dirty_clear_refs_fd, "4", 1) == 1 &&
+       ! smal_soft_dirty_bits((void*) page, os_page_size) ) {
+    page[0] = 2;
+    ok = smal_soft_dirty_bits((void*) page, os_page_size) != 0;
+  }
+  munmap((void*) page, os_page_size);
+
+ done:
+  if ( ! ok ) {
+    if ( soft_dirty_clear_refs_fd >= 0 ) close(soft_dirty_clear_refs_fd);
+    if ( soft_dirty_pagemap_fd >= 0 ) close(soft_dirty_pagemap_fd);
+    soft_dirty_clear_refs_fd = soft_dirty_pagemap_fd = -1;
+  }
+  smal_debug(write_barrier, 1, " soft-dirty %s", ok ? "available" : "not available: using mprotect()");
+  return ok;
+}
+
+static
+void smal_soft_dirty_init()
+{
+  const char *s;
+  if ( (s = getenv("SMAL_SOFT_DIRTY")) )
+    smal_soft_dirty = atoi(s);
+  if ( smal_soft_dirty )
+    smal_soft_dirty = smal_soft_dirty_probe();
+}
+
+/* Before marking. */
+static
+void smal_buffer_update_mutation(smal_buffer *self)
+{
+  int dirty;
+  if ( ! (smal_soft_dirty && self->mutation_write_barrier) )
+    return;
+#if SMAL_WRITE_BARRIER_SLICES
+  /* Read all slices, one os page each: others may be dirty even if the buffer is already mutated. */
+  if ( self->slice_dirty ) {
+    size_t s, dirty_n = 0;
+    int ok = smal_soft_dirty_read(smal_buffer_to_page(self), self->slice_n);
+    for ( s = 0; s < self->slice_n; ++ s ) {
+      if ( ! self->slice_dirty[s] &&
+	   (! ok || (soft_dirty_entries[s] & smal_pagemap_SOFT_DIRTY)) ) {
+	self->slice_dirty[s] = 1;
+	++ dirty_n;
+      }
+    }
+    if ( dirty_n ) {
+      smal_LOCK_STATS(lock);
+      smal_UPDATE_STATS(slice_mutations, += dirty_n);
+      smal_LOCK_STATS(unlock);
+    }
+    dirty = dirty_n != 0;
+  } else
+#endif
+  dirty = ! self->mutation && smal_soft_dirty_bits(smal_buffer_to_page(self), self->mmap_size);
+  if ( dirty && ! self->mutation ) {
+    smal_thread_rwlock_wrlock(&self->mutation_lock);
+    self->mutation = 1;
+    smal_thread_rwlock_unlock(&self->mutation_lock);
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(buffer_mutations, += 1);
+    smal_LOCK_STATS(unlock);
+  }
+}
@@ -0,0 +1,110 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Card marking.
+
+  Buffers of a type with desc.card_marking have a card table:
+  one byte per smal_card_SIZE bytes of the buffer's mmap region.
+  smal_write_barrier() sets the card of each stored field; there is no write protection.
+
+  smal_buffer_before_mark() takes the cards dirtied since the last collection:
+  any dirty card sets the buffer's mutation flag, which invalidates its remembered set.
+  A minor collection greys only the old objects on dirty cards.
+
+  smal_write_barrier() only looks up the buffer of obj once _smal_card_marking is set,
+  when the first desc.card_marking type is created.
+*/
+
+int _smal_card_marking;
+
+static
+void smal_buffer_cards_init(smal_buffer *self)
+{
+  /* Whole words, for smal_buffer_cards_take(). */
+  self->cards_size = ((self->mmap_size >> smal_card_SHIFT) + sizeof(size_t) - 1) & ~ (sizeof(size_t) - 1);
+  if ( ! (self->cards = malloc(self->cards_size)) )
+    abort();
+  malloc_overhead_size += self->cards_size;
+  memset(self->cards, 0, self->cards_size);
+  self->card_base = (size_t) self->cards - ((size_t) self->mmap_addr >> smal_card_SHIFT);
+  /* Cards replace write protection. */
+  self->mutation_write_barrier = 0;
+}
+
+static
+void smal_buffer_cards_free(smal_buffer *self)
+{
+  if ( self->cards ) {
+    free(self->cards);
+    malloc_overhead_size -= self->cards_size;
+    self->cards = 0;
+    self->card_base = 0;
+  }
+}
+
+#if SMAL_GENERATIONAL
+/* Grey the old objects on card c. */
+static
+void smal_buffer_card_grey(smal_buffer *self, size_t c)
+{
+  void *card = self->mmap_addr + (c << smal_card_SHIFT);
+  void *card_end = card + smal_card_SIZE;
+  size_t i, i_end;
+
+  if ( card_end <= self->begin_ptr || card >= self->end_ptr )
+    return;
+  i = card > self->begin_ptr ? smal_buffer_ptr_i(self, card) : 0;
+  i_end = card_end < self->end_ptr ? smal_buffer_ptr_i(self, card_end - 1) + 1 : self->object_capacity;
+  for ( ; i < i_end; ++ i ) {
+    /* Free objects can be marked by conservative pointers. */
+    if ( smal_bitmap_setQ(&self->mark_bits, i) && ! smal_bitmap_setQ(&self->free_bits, i) ) {
+      smal_bitmap_set(&self->grey_bits, i);
+      self->mark_overflow = mark_queue_overflow = 1;
+    }
+  }
+}
+#endif
+
+/* Clear the cards; returns the number that were dirty.
+   If grey, grey the old objects on dirty cards for smal_collect_minor(). */
+static
+size_t smal_buffer_cards_take(smal_buffer *self, int grey)
+{
+  size_t *w = (size_t*) self->cards;
+  size_t n = self->cards_size / sizeof(size_t);
+  size_t dirty_n = 0;
+  size_t i, c;
+
+  for ( i = 0; i < n; ++ i ) {
+    size_t word;
+    /* Mutators may set cards concurrently. */
+    if ( ! w[i] || ! (word = __sync_lock_test_and_set(&w[i], 0)) )
+      continue;
+    for ( c = i * sizeof(size_t); c < (i + 1) * sizeof(size_t); ++ c ) {
+      if ( ! ((unsigned char*) &word)[c % sizeof(size_t)] )
+	continue;
+      ++ dirty_n;
+#if SMAL_WRITE_BARRIER_SLICES
+      /* Invalidates the remembered sets of the card's slice. */
+      if ( self->slice_dirty )
+	self->slice_dirty[(c << smal_card_SHIFT) >> smal_slice_shift] = 1;
+#endif
+#if SMAL_GENERATIONAL
+      if ( grey )
+	smal_buffer_card_grey(self, c);
+#endif
+    }
+  }
+
+  if ( dirty_n ) {
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(buffer_mutations, += 1);
+    smal_LOCK_STATS(unlock);
+  }
+  return dirty_n;
+}
@@ -0,0 +1,318 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Concurrent marking with a snapshot-at-the-beginning (SATB) barrier.
+
+  smal_collect_start_concurrent() pauses the buffers and queues the roots on the calling thread,
+  then hands its mark queue to a marker thread, which marks while mutators run.
+
+  While it marks, smal_write_barrier() logs the old value of each overwritten pointer field
+  into its thread's smal_satb_log.  Full logs are published to satb_full for the marker.
+  Every object reachable when the collection started is either marked through the heap
+  or through a logged old value.  Objects allocated during the collection are black.
+
+  When the marker is idle, smal_collect_step() (or smal_collect() at any time) stops it,
+  takes back its mark queue, drains all logs, rescans the roots and finishes marking on the calling thread.
+
+  During that final step the other mutators are parked: a thread appending to its log sets satb_busy,
+  then checks satb_parking.  The finishing thread sets satb_parking, then waits until no thread is busy.
+  From then on, until marking is finished and logging is disabled, any thread storing a pointer
+  waits in smal_write_barrier(), so no old value escapes the logs and no log is read while appended to.
+*/
+
+#include <sched.h> /* sched_yield() */
+
+#ifndef smal_satb_log_SIZE
+#define smal_satb_log_SIZE 254
+#endif
+
+typedef struct smal_satb_log {
+  struct smal_satb_log *next;
+  size_t n;
+  void *ptrs[smal_satb_log_SIZE];
+} smal_satb_log;
+
+int _smal_collect_satb;
+
+static pthread_mutex_t satb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t satb_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t satb_park_cond = PTHREAD_COND_INITIALIZER;
+static volatile int satb_parking; /** Under satb_mutex: mutators wait in smal_satb_enter(). */
+static smal_thread *satb_finisher; /** The thread finishing marking; it is not parked. */
+static smal_satb_log *satb_full; /** Published logs, for the marker. */
+static smal_satb_log *satb_free;
+static pthread_t concurrent_marker;
+static smal_mark_queue *concurrent_mark_queue; /** Handed between the collecting thread and the marker. */
+static volatile int concurrent_mark_stop, concurrent_mark_idle;
+
+/* Under satb_mutex. */
+static
+smal_satb_log *smal_satb_log_new()
+{
+  smal_satb_log *log;
+  if ( (log = satb_free) ) {
+    satb_free = log->next;
+  } else {
+    if ( ! (log = malloc(sizeof(*log))) )
+      abort();
+    malloc_overhead_size += sizeof(*log);
+  }
+  log->n = 0;
+  return log;
+}
+
+/* Under satb_mutex. */
+static
+void smal_satb_log_push_full(smal_satb_log *log)
+{
+  log->next = satb_full;
+  satb_full = log;
+  pthread_cond_signal(&satb_cond);
+}
+
+/* Before thr touches its log; waits while the finishing thread has mutators parked. */
+static inline
+void smal_satb_enter(smal_thread *thr)
+{
+  for (;;) {
+    thr->satb_busy = 1;
+    __sync_synchronize();
+    if ( smal_likely(! satb_parking) || thr == satb_finisher )
+      return;
+    __sync_lock_release(&thr->satb_busy);
+    pthread_mutex_lock(&satb_mutex);
+    while ( satb_parking )
+      pthread_cond_wait(&satb_park_cond, &satb_mutex);
+    pthread_mutex_unlock(&satb_mutex);
+  }
+}
+
+static inline
+void smal_satb_exit(smal_thread *thr)
+{
+  __sync_lock_release(&thr->satb_busy);
+}
+
+void _smal_satb_log(void *old)
+{
+  smal_thread *thr = smal_thread_self();
+  smal_satb_log *log;
+
+  smal_satb_enter(thr);
+  /* Marking may have finished while parked. */
+  if ( smal_likely(_smal_collect_satb) ) {
+    log = thr->satb_log;
+    if ( smal_unlikely(! log || log->n == smal_satb_log_SIZE) ) {
+      pthread_mutex_lock(&satb_mutex);
+      if ( log )
+	smal_satb_log_push_full(log);
+      thr->satb_log = log = smal_satb_log_new();
+      pthread_mutex_unlock(&satb_mutex);
+    }
+    log->ptrs[log->n ++] = old;
+  }
+  smal_satb_exit(thr);
+}
+
+static
+int smal_satb_wait_thread(smal_thread *thr, void *arg)
+{
+  while ( * (volatile int*) &thr->satb_busy )
+    sched_yield();
+  return 0;
+}
+
+/* Park all other mutators at their next log append. */
+static
+void smal_satb_park()
+{
+  satb_finisher = smal_thread_self();
+  satb_parking = 1;
+  __sync_synchronize();
+  smal_thread_each(smal_satb_wait_thread, 0);
+}
+
+static
+void smal_satb_unpark()
+{
+  pthread_mutex_lock(&satb_mutex);
+  satb_parking = 0;
+  satb_finisher = 0;
+  pthread_cond_broadcast(&satb_park_cond);
+  pthread_mutex_unlock(&satb_mutex);
+}
+
+/* Publish a thread's partial log. */
+static
+int smal_satb_log_publish_thread(smal_thread *thr, void *arg)
+{
+  smal_satb_log *log;
+  if ( (log = thr->satb_log) && log->n ) {
+    pthread_mutex_lock(&satb_mutex);
+    smal_satb_log_push_full(log);
+    thr->satb_log = 0;
+    pthread_mutex_unlock(&satb_mutex);
+  }
+  return 0;
+}
+
+/* Queue the pointers in published logs; returns 0 if there were none. */
+static
+int smal_satb_take()
+{
+  smal_satb_log *log, *last = 0;
+  size_t i;
+  int any = 0;
+
+  pthread_mutex_lock(&satb_mutex);
+  log = satb_full;
+  satb_full = 0;
+  pthread_mutex_unlock(&satb_mutex);
+  if ( ! log )
+    return 0;
+
+  for ( last = log; ; last = last->next ) {
+    for ( i = 0; i < last->n; ++ i ) {
+      if ( last->ptrs[i] ) {
+	smal_mark_queue_push(0, last->ptrs[i]);
+	any = 1;
+      }
+    }
+    if ( ! last->next )
+      break;
+  }
+
+  pthread_mutex_lock(&satb_mutex);
+  last->next = satb_free;
+  satb_free = log;
+  pthread_mutex_unlock(&satb_mutex);
+  return any;
+}
+
+static
+void *smal_concurrent_mark_main(void *arg)
+{
+  mark_queue = concurrent_mark_queue;
+  concurrent_mark_queue = 0;
+
+  while ( ! concurrent_mark_stop ) {
+    if ( ! smal_mark_queue_mark_n(smal_collect_step_CHECK_INTERVAL) ||
+	 smal_mark_queue_rescan(smal_collect_step_CHECK_INTERVAL, 0) ||
+	 smal_satb_take() )
+      continue;
+    pthread_mutex_lock(&satb_mutex);
+    concurrent_mark_idle = 1;
+    while ( ! satb_full && ! concurrent_mark_stop )
+      pthread_cond_wait(&satb_cond, &satb_mutex);
+    concurrent_mark_idle = 0;
+    pthread_mutex_unlock(&satb_mutex);
+  }
+
+  /* Hand back what is left. */
+  concurrent_mark_queue = mark_queue;
+  mark_queue = 0;
+  return 0;
+}
+
+int _smal_collect_start_concurrent()
+{
+  if ( no_collect || in_collect )
+    return 0;
+  if ( smal_thread_lock_lock(&_smal_collect_inner_lock) )
+    return 0;
+
+  smal_collect_begin_mark();
+  smal_collect_mark_registers_and_roots();
+  _smal_collect_satb = 1;
+
+  concurrent_mark_queue = mark_queue;
+  mark_queue = 0;
+  smal_mark_queue_new(1);
+  concurrent_mark_stop = concurrent_mark_idle = 0;
+  collect_phase = smal_collect_phase_CONCURRENT_MARK;
+  smal_assert(pthread_create(&concurrent_marker, 0, smal_concurrent_mark_main, 0), == 0);
+  return 1;
+}
+
+/* Returns 1 if the marker is still busy, unless finish. */
+static
+int smal_collect_step_concurrent_mark(int finish)
+{
+  if ( ! finish && ! concurrent_mark_idle ) {
+    /* Let the marker run. */
+    sched_yield();
+    return 1;
+  }
+
+  pthread_mutex_lock(&satb_mutex);
+  concurrent_mark_stop = 1;
+  pthread_cond_signal(&satb_cond);
+  pthread_mutex_unlock(&satb_mutex);
+  smal_assert(pthread_join(concurrent_marker, 0), == 0);
+
+  smal_mark_queue_adopt(concurrent_mark_queue);
+  concurrent_mark_queue = 0;
+
+  /* No thread logs until marking is finished. */
+  smal_satb_park();
+  smal_thread_each(smal_satb_log_publish_thread, 0);
+  smal_satb_take();
+
+  /* Finish on this thread; also rescans roots. */
+  collect_phase = smal_collect_phase_MARK;
+  (void) smal_collect_step_mark(0);
+
+  _smal_collect_satb = 0;
+  smal_satb_unpark();
+  return 0;
+}
+
+/* Publish a thread's partial log and release its empty one. */
+static
+int smal_satb_log_release_thread(smal_thread *thr, void *arg)
+{
+  smal_satb_log *log;
+  (void) smal_satb_log_publish_thread(thr, arg);
+  if ( (log = thr->satb_log) ) {
+    pthread_mutex_lock(&satb_mutex);
+    log->next = satb_free;
+    satb_free = log;
+    thr->satb_log = 0;
+    pthread_mutex_unlock(&satb_mutex);
+  }
+  return 0;
+}
+
+/* smal_thread_exit_hook */
+static
+void smal_satb_thread_exit(smal_thread *thr)
+{
+  if ( initialized ) {
+    smal_satb_enter(thr);
+    (void) smal_satb_log_release_thread(thr, 0);
+    smal_satb_exit(thr);
+  }
+}
+
+/* Only during smal_shutdown(). */
+static
+void smal_satb_free_all()
+{
+  smal_satb_log *log;
+  smal_thread_each(smal_satb_log_release_thread, 0);
+  while ( (log = satb_full) ) {
+    satb_full = log->next;
+    log->next = satb_free;
+    satb_free = log;
+  }
+  while ( (log = satb_free) ) {
+    satb_free = log->next;
+    free(log);
+    malloc_overhead_size -= sizeof(*log);
+  }
+}
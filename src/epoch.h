@@ -0,0 +1,63 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Included directly into smal.c */
+
+/*
+  Epoch-based reclamation for lock-free readers.
+
+  A reader brackets its lock-free reads with smal_epoch_enter() and smal_epoch_exit(),
+  which publish the global epoch it started in, in its smal_thread.
+  A writer unlinks an object, then stamps it with smal_epoch_retire(), which advances
+  the global epoch.  The object may be freed once smal_epoch_safe() is greater than its stamp:
+  every reader that could have seen it has exited.
+*/
+
+static size_t epoch_global = 1;
+
+static inline
+smal_thread *smal_epoch_enter()
+{
+  smal_thread *thr = smal_thread_self();
+  thr->epoch = epoch_global;
+  /* Publish thr->epoch before reading shared pointers. */
+  __sync_synchronize();
+  return thr;
+}
+
+static inline
+void smal_epoch_exit(smal_thread *thr)
+{
+  /* Finish reads before clearing thr->epoch. */
+  __sync_synchronize();
+  thr->epoch = 0;
+}
+
+/* Call after an object is unlinked; returns its retire epoch. */
+static inline
+size_t smal_epoch_retire()
+{
+  return __sync_fetch_and_add(&epoch_global, 1);
+}
+
+static
+int smal_epoch_safe_thread(smal_thread *thr, void *arg)
+{
+  size_t epoch = thr->epoch;
+  if ( epoch && epoch < * (size_t*) arg )
+    * (size_t*) arg = epoch;
+  return 0;
+}
+
+/* Objects retired before the returned epoch cannot be referenced by any reader. */
+static
+size_t smal_epoch_safe()
+{
+  size_t epoch;
+  __sync_synchronize();
+  epoch = epoch_global;
+  smal_thread_each(smal_epoch_safe_thread, &epoch);
+  return epoch;
+}
@@ -18,7 +18,7 @@ int _smal_finalizer_debug;
 static smal_type *smal_finalizer_type_;
 static void *smal_finalizer_mark(smal_finalizer *obj)
 {
-  extern void * _smal_mark_referrer;
+  extern smal_mark_TLS void * _smal_mark_referrer;
   if ( _smal_finalizer_debug ) fprintf(stderr, "    smal_finalizer_mark(%p) from %p\n", obj, _smal_mark_referrer);
   /* NOTE: obj->referred is NOT MARKED. */
   smal_mark_ptr(obj, obj->data);
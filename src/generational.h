@@ -0,0 +1,129 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Generational collection with sticky mark bits.
+
+  Objects that survive a collection keep their mark bits: they are old.
+  Objects allocated since are unmarked: they are young.
+
+  smal_collect_minor() does not clear mark bits, so marking stops at old objects.
+  It marks from the roots and from the old objects of each dirty buffer:
+  a buffer whose mutation flag was set since the last collection,
+  or one that does not track mutation with the write barrier.
+  The old objects of a dirty buffer are set in its grey_bits and scanned by smal_mark_queue_rescan().
+  A buffer with cards only greys the old objects on dirty cards, see card_table.h;
+  a buffer with write barrier slices, only those on dirty slices, see buffer_slices.h.
+
+  Only buffers allocated from since the last collection are swept: other buffers have no young objects.
+  Old garbage is reclaimed by the next smal_collect().
+
+  Without a way to tell whether a buffer is dirty, each minor collection would rescan it whole.
+  So the first smal_collect_minor() sets smal_generational, and puts every existing buffer
+  under the write barrier, assuming it was mutated; later buffers track mutation as they are created.
+  Buffers that smal_write_barrier_adapt later stops tracking, and large object spans, are still rescanned whole.
+  Without SMAL_BUFFER_WRITE_BARRIER, smal_collect_minor() is a full collection.
+*/
+
+int smal_generational;
+
+static int collect_minor_arm; /** If true, this minor collection puts buffers under the write barrier. */
+
+/* Start tracking mutation in a buffer that does not; assume it was mutated. */
+static
+void smal_buffer_generational_arm(smal_buffer *self)
+{
+#if SMAL_BUFFER_WRITE_BARRIER
+  if ( self->mutation_write_barrier || self->mmap_size != smal_page_size )
+    return;
+#if SMAL_CARD_MARKING
+  if ( self->cards )
+    return;
+#endif
+  self->mutation_write_barrier = 1;
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( ! self->slice_dirty )
+    smal_buffer_slices_init(self);
+  memset(self->slice_dirty, 1, self->slice_n);
+#endif
+  self->mutation = 1;
+#endif
+}
+
+/* Grey the old objects of a dirty buffer. */
+static
+void smal_buffer_before_minor_mark(smal_buffer *self)
+{
+  size_t i, n;
+
+  if ( collect_minor_arm )
+    smal_buffer_generational_arm(self);
+
+#if SMAL_CARD_MARKING
+  /* Greyed by smal_buffer_cards_take(). */
+  if ( self->cards )
+    return;
+#endif
+#if SMAL_BUFFER_WRITE_BARRIER
+  if ( self->mutation_write_barrier && ! self->mutation )
+    return;
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  /* Only the old objects on dirty slices. */
+  if ( self->mutation_write_barrier && self->slice_dirty ) {
+    smal_buffer_slices_grey_dirty(self);
+    return;
+  }
+#endif
+
+  /* Free objects can be marked by conservative pointers. */
+  n = (self->object_capacity + smal_BITS_PER_WORD - 1) / smal_BITS_PER_WORD;
+  for ( i = 0; i < n; ++ i ) {
+    unsigned int old = self->mark_bits.bits[i] & ~ self->free_bits.bits[i];
+    if ( old ) {
+      self->grey_bits.bits[i] |= old;
+      self->mark_overflow = mark_queue_overflow = 1;
+    }
+  }
+}
+
+void _smal_collect_minor()
+{
+  smal_debug(collect, 1, "()");
+
+  if ( no_collect ) return;
+
+#if SMAL_INCREMENTAL
+  /* Finish an incremental collection. */
+  if ( collect_phase ) {
+    _smal_collect_step(0);
+    return;
+  }
+#endif
+
+  if ( in_collect ) return;
+
+#if ! SMAL_BUFFER_WRITE_BARRIER
+  /* No buffer but those with cards could tell it is clean. */
+  _smal_collect_inner();
+  return;
+#endif
+
+  if ( ! smal_thread_lock_lock(&_smal_collect_inner_lock) ) {
+    collect_minor = 1;
+    if ( ! smal_generational )
+      smal_generational = collect_minor_arm = 1;
+    smal_collect_begin_mark();
+    collect_minor_arm = 0;
+    smal_collect_mark_registers_and_roots();
+    smal_mark_queue_mark_all();
+    smal_collect_end_mark();
+    collect_minor = 0;
+
+    _smal_collect_sweep_buffers(0);
+  }
+}
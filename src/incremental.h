@@ -0,0 +1,152 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Incremental collection.
+
+  smal_collect_start() pauses the buffers to collect and queues the roots, as smal_collect() does.
+  Each smal_collect_step() then marks from the mark queue, rescans grey objects or sweeps buffers
+  until its budget is spent.  Once the mark queue is empty and no object is grey,
+  one step rescans the roots and finishes marking without a budget.
+
+  Tri-color state:
+  white objects are unmarked;
+  grey objects are marked, and queued or set in their buffer's grey_bits;
+  black objects are marked and scanned.
+
+  Between steps, smal_write_barrier() shades each pointer stored into an object grey,
+  so no black object refers to a white object.
+  Roots are not barriered; they are rescanned by the last mark step.
+  Objects allocated during the collection are marked, i.e. black, see smal_buffer_alloc_object().
+
+  Between steps the mark queue is held in collect_mark_queue, not in the calling thread's mark_queue,
+  so any thread may take the next step or finish the collection with smal_collect().
+*/
+
+#include <time.h> /* clock_gettime() */
+
+#define smal_collect_phase_MARK 1
+#define smal_collect_phase_SWEEP 2
+#define smal_collect_phase_CONCURRENT_MARK 3 /* See concurrent_mark.h. */
+
+/* Objects marked or grey objects scanned between clock checks. */
+#ifndef smal_collect_step_CHECK_INTERVAL
+#define smal_collect_step_CHECK_INTERVAL 256
+#endif
+
+int _smal_collect_marking;
+
+static void *collect_sweep_next; /** Next buffer in buffer_collecting to sweep. */
+static smal_mark_queue *collect_mark_queue; /** The mark queue between mark steps. */
+
+static inline
+unsigned long long smal_collect_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define smal_collect_deadlineQ(DEADLINE) ((DEADLINE) && smal_collect_now_ns() >= (DEADLINE))
+
+void _smal_write_barrier(void *obj, void *value)
+{
+  /* Buffers are not freed while marking: no smal_epoch_enter() needed. */
+  (void) smal_mark_grey(obj, value);
+}
+
+int _smal_collect_start()
+{
+  if ( no_collect || in_collect )
+    return 0;
+  if ( smal_thread_lock_lock(&_smal_collect_inner_lock) )
+    return 0;
+
+  smal_collect_begin_mark();
+  _smal_collect_marking = 1;
+  smal_collect_mark_registers_and_roots();
+  collect_mark_queue = mark_queue;
+  mark_queue = 0;
+  collect_phase = smal_collect_phase_MARK;
+  return 1;
+}
+
+/* Returns 1 if marking is not done by deadline. */
+static
+int smal_collect_step_mark(unsigned long long deadline)
+{
+  smal_mark_queue_adopt(collect_mark_queue);
+  collect_mark_queue = 0;
+
+  for (;;) {
+    if ( smal_mark_queue_mark_n(smal_collect_step_CHECK_INTERVAL) &&
+	 ! smal_mark_queue_rescan(smal_collect_step_CHECK_INTERVAL, 0) )
+      break;
+    if ( smal_collect_deadlineQ(deadline) ) {
+      collect_mark_queue = mark_queue;
+      mark_queue = 0;
+      return 1;
+    }
+  }
+
+  /* Roots may have changed since smal_collect_start(). */
+  smal_collect_mark_registers_and_roots();
+  smal_mark_queue_mark_all();
+  smal_collect_end_mark();
+  _smal_collect_marking = 0;
+
+  collect_phase = smal_collect_phase_SWEEP;
+  collect_sweep_next = buffer_collecting.next;
+  return 0;
+}
+
+/* Returns 1 if sweeping is not done by deadline. */
+static
+int smal_collect_step_sweep(unsigned long long deadline)
+{
+  smal_thread_rwlock_wrlock(&buffer_collecting_lock);
+  ++ in_sweep;
+
+  while ( collect_sweep_next != (void*) &buffer_collecting ) {
+    smal_buffer *buf = collect_sweep_next;
+    collect_sweep_next = buf->next;
+    smal_buffer_sweep(buf);
+    if ( smal_collect_deadlineQ(deadline) ) {
+      -- in_sweep;
+      smal_thread_rwlock_unlock(&buffer_collecting_lock);
+      return 1;
+    }
+  }
+
+  collect_phase = 0;
+  smal_collect_end_sweep();
+  return 0;
+}
+
+#if SMAL_CONCURRENT_MARK
+static int smal_collect_step_concurrent_mark(int finish);
+#endif
+
+int _smal_collect_step(unsigned long budget_ns)
+{
+  unsigned long long deadline = budget_ns ? smal_collect_now_ns() + budget_ns : 0;
+
+#if SMAL_CONCURRENT_MARK
+  if ( collect_phase == smal_collect_phase_CONCURRENT_MARK &&
+       smal_collect_step_concurrent_mark(! budget_ns) )
+    return 1;
+#endif
+
+  if ( collect_phase == smal_collect_phase_MARK &&
+       smal_collect_step_mark(deadline) )
+    return 1;
+  if ( collect_phase == smal_collect_phase_SWEEP &&
+       smal_collect_step_sweep(deadline) )
+    return 1;
+  return 0;
+}
+
@@ -7,6 +7,35 @@
 
 #define smal_mark_queue_SIZE 1020
 
+/*
+  Prefetch FIFO:
+  entries popped from the mark queue are mapped to their buffer, realigned and
+  prefetched, then marked smal_mark_prefetch_SIZE - 1 entries later,
+  so cache misses on objects and mark bits overlap.
+  The pointer returned by a mark_func re-enters the FIFO.
+*/
+#ifndef smal_mark_prefetch_SIZE
+#if SMAL_MARK_PREFETCH
+#define smal_mark_prefetch_SIZE 8 /* Must be a power of 2. */
+#else
+#define smal_mark_prefetch_SIZE 1
+#endif
+#endif
+
+#if SMAL_MARK_PREFETCH
+#define smal_mark_PREFETCH(ADDR, RW) __builtin_prefetch(ADDR, RW)
+#else
+#define smal_mark_PREFETCH(ADDR, RW) ((void) 0)
+#endif
+
+typedef struct smal_mark_prefetch {
+  struct {
+    void *referrer, *ptr;
+    smal_buffer *buf;
+  } entries[smal_mark_prefetch_SIZE];
+  int head, n;
+} smal_mark_prefetch;
+
 typedef struct smal_mark_queue {
   void **front; // , **back;
   void *ptrs[smal_mark_queue_SIZE];
@@ -14,9 +43,74 @@ typedef struct smal_mark_queue {
   struct smal_mark_queue *prev;
 } smal_mark_queue;
 
-static smal_mark_queue *mark_queue;
+/*
+  Chunk pool:
+  drained chunks return to mark_queue_pool and are reused by later collections.
+  At most smal_mark_queue_max bytes of chunks exist, pooled or not;
+  each marker always gets its first chunk.
+
+  Overflow:
+  when no chunk is available, smal_mark_queue_overflow() marks the object and sets its grey bit;
+  smal_mark_queue_rescan() then scans the grey objects of each buffer with mark_overflow,
+  until no more overflow.
+*/
+#ifndef smal_mark_queue_max_default
+#define smal_mark_queue_max_default ((size_t) 16 * 1024 * 1024)
+#endif
+
+size_t smal_mark_queue_max = smal_mark_queue_max_default;
+size_t smal_mark_queue_overflow_n;
+
+static smal_mark_TLS smal_mark_queue *mark_queue; /** Per marker thread. */
 static int mark_queue_depth, mark_queue_depth_max;
 static int mark_queue_add_depth;
+static smal_mark_queue *mark_queue_pool;
+static size_t mark_queue_chunk_n; /** Chunks allocated, including those in mark_queue_pool. */
+static int mark_queue_overflow; /** If true, some buffer has mark_overflow. */
+
+#if SMAL_PARALLEL_MARK
+static pthread_mutex_t mark_queue_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define smal_mark_queue_pool_lock() pthread_mutex_lock(&mark_queue_pool_mutex)
+#define smal_mark_queue_pool_unlock() pthread_mutex_unlock(&mark_queue_pool_mutex)
+#else
+#define smal_mark_queue_pool_lock() ((void) 0)
+#define smal_mark_queue_pool_unlock() ((void) 0)
+#endif
+
+/* Returns 0 if smal_mark_queue_max is reached, unless force. */
+static
+smal_mark_queue *smal_mark_queue_chunk_alloc(int force)
+{
+  smal_mark_queue *s;
+  smal_mark_queue_pool_lock();
+  if ( (s = mark_queue_pool) ) {
+    mark_queue_pool = s->prev;
+  } else if ( force || ! smal_mark_queue_max ||
+	      (mark_queue_chunk_n + 1) * sizeof(*s) <= smal_mark_queue_max ) {
+    if ( ! (s = malloc(sizeof(*s))) )
+      abort();
+    ++ mark_queue_chunk_n;
+    malloc_overhead_size += sizeof(*s);
+  }
+  smal_mark_queue_pool_unlock();
+  return s;
+}
+
+static
+void smal_mark_queue_chunk_free(smal_mark_queue *s)
+{
+  smal_mark_queue_pool_lock();
+  if ( smal_mark_queue_max && mark_queue_chunk_n * sizeof(*s) > smal_mark_queue_max ) {
+    /* smal_mark_queue_max was lowered, or a marker forced its first chunk. */
+    free(s);
+    -- mark_queue_chunk_n;
+    malloc_overhead_size -= sizeof(*s);
+  } else {
+    s->prev = mark_queue_pool;
+    mark_queue_pool = s;
+  }
+  smal_mark_queue_pool_unlock();
+}
 
 static inline
 void smal_mark_queue_free()
@@ -27,26 +121,57 @@ void smal_mark_queue_free()
 #endif
   while ( s ) {
     smal_mark_queue *s_prev = s->prev;
-    free(s);
+    smal_mark_queue_chunk_free(s);
     s = s_prev;
   }
   mark_queue = 0;
 }
 
+/* Only during smal_shutdown(), after marker threads have stopped. */
+static
+void smal_mark_queue_pool_free()
+{
+  smal_mark_queue *s;
+  smal_mark_queue_free();
+  while ( (s = mark_queue_pool) ) {
+    mark_queue_pool = s->prev;
+    free(s);
+    -- mark_queue_chunk_n;
+    malloc_overhead_size -= sizeof(*s);
+  }
+}
+
 static inline
 void smal_mark_queue_mark(int);
 
+/* Returns 0 if no chunk is available, unless force. */
 static inline
-void smal_mark_queue_new()
+int smal_mark_queue_new(int force)
 {
 #if 0
   fprintf(stderr, "  s_m_q_n()\n");
 #endif
-  smal_mark_queue *new_s = malloc(sizeof(*new_s));
+  smal_mark_queue *new_s = smal_mark_queue_chunk_alloc(force);
+  if ( ! new_s )
+    return 0;
   new_s->front = new_s->ptrs;
   // new_s->back = new_s->ptrs + smal_mark_queue_SIZE;
   new_s->prev = mark_queue;
   mark_queue = new_s;
+  return 1;
+}
+
+/* Put the chunks of q on top of this thread's mark_queue. */
+static inline
+void smal_mark_queue_adopt(smal_mark_queue *q)
+{
+  smal_mark_queue *bottom;
+  if ( ! q )
+    return;
+  for ( bottom = q; bottom->prev; bottom = bottom->prev )
+    ;
+  bottom->prev = mark_queue;
+  mark_queue = q;
 }
 
 static inline
@@ -54,7 +179,7 @@ void smal_mark_queue_start()
 {
   mark_queue_depth_max = mark_queue_depth = mark_queue_add_depth = 0;
   smal_mark_queue_free();
-  smal_mark_queue_new();
+  smal_mark_queue_new(1);
 }
 
 static inline
@@ -75,7 +200,7 @@ void smal_mark_queue_mark(int one)
     }
     if ( mark_queue->prev ) {
       smal_mark_queue *s_prev = mark_queue->prev;
-      free(mark_queue);
+      smal_mark_queue_chunk_free(mark_queue);
       mark_queue = s_prev;
 #if 0
       fprintf(stderr, "%*s F\n", mark_queue_depth, " ");
@@ -90,13 +215,187 @@ void smal_mark_queue_mark(int one)
 #endif
 }
 
+/* Pop one entry; returns 0 if empty, or this thread has no mark_queue. */
+static inline
+int smal_mark_queue_pop(void **referrerp, void **ptrp)
+{
+  if ( smal_unlikely(! mark_queue) )
+    return 0;
+  while ( mark_queue->front == mark_queue->ptrs ) {
+    smal_mark_queue *s_prev;
+    if ( ! (s_prev = mark_queue->prev) )
+      return 0;
+    smal_mark_queue_chunk_free(mark_queue);
+    mark_queue = s_prev;
+  }
+  *ptrp = *(-- mark_queue->front);
+  *referrerp = *(-- mark_queue->front);
+  return 1;
+}
+
+/* Mark ptr and leave its references to smal_mark_queue_rescan(); returns 1 if ptr became grey. */
+static
+int smal_mark_grey(void *referrer, void *ptr)
+{
+  smal_buffer *buf;
+  size_t i;
+  if ( ! ((buf = smal_ptr_to_buffer(ptr)) && smal_buffer_ptr_is_validQ(buf, ptr)) )
+    return 0;
+  i = smal_buffer_ptr_i(buf, ptr);
+  ptr = smal_buffer_i_ptr(buf, i);
+  smal_buffer_mark_remember(buf, referrer, ptr);
+  if ( smal_buffer_mark_test_set(buf, ptr) || ! buf->markable )
+    return 0;
+  /* Markers and mutators may grey objects in the same buffer. */
+  smal_bitmap_set_atomic(&buf->grey_bits, i);
+  buf->mark_overflow = 1;
+  mark_queue_overflow = 1;
+  return 1;
+}
+
+/* The mark queue is full. */
+static inline
+void smal_mark_queue_overflow(void *referrer, void *ptr)
+{
+  if ( smal_mark_grey(referrer, ptr) )
+    __sync_add_and_fetch(&smal_mark_queue_overflow_n, 1);
+}
+
+static inline
+void smal_mark_queue_push(void *referrer, void *ptr)
+{
+  if ( smal_unlikely(! mark_queue || mark_queue->front >= mark_queue->back) && ! smal_mark_queue_new(0) ) {
+    smal_mark_queue_overflow(referrer, ptr);
+    return;
+  }
+  *(mark_queue->front ++) = referrer;
+  *(mark_queue->front ++) = ptr;
+#if 0
+  // fprintf(stderr, "%*s q(%p)\n", mark_queue_depth, " ", ptr);
+  if ( mark_queue_depth_max < ++ mark_queue_depth ) mark_queue_depth_max = mark_queue_depth;
+#endif
+}
+
+/* Drops ptr if it is not in a buffer. */
+static inline
+void smal_mark_prefetch_add(smal_mark_prefetch *self, void *referrer, void *ptr)
+{
+  smal_buffer *buf;
+  if ( (buf = smal_ptr_to_buffer(ptr)) && smal_buffer_ptr_is_validQ(buf, ptr) ) {
+    size_t i = smal_buffer_ptr_i(buf, ptr);
+    int j = (self->head + self->n ++) & (smal_mark_prefetch_SIZE - 1);
+    self->entries[j].referrer = referrer;
+    self->entries[j].ptr = ptr = smal_buffer_i_ptr(buf, i);
+    self->entries[j].buf = buf;
+    smal_mark_PREFETCH(&smal_bitmap_w(&buf->mark_bits, i), 1);
+    smal_mark_PREFETCH(ptr, 0);
+  }
+}
+
+/* Mark the oldest entry. */
+static inline
+void smal_mark_prefetch_mark(smal_mark_prefetch *self)
+{
+  int j = self->head;
+  void *ptr = self->entries[j].ptr;
+  void *next;
+  self->head = (j + 1) & (smal_mark_prefetch_SIZE - 1);
+  -- self->n;
+  if ( (next = _smal_buffer_mark_ptr(self->entries[j].buf, self->entries[j].referrer, ptr)) )
+    smal_mark_prefetch_add(self, ptr, next);
+}
+
+/* Mark at most max_n entries; returns 1 if the mark queue was drained. */
+static
+int smal_mark_queue_mark_n(size_t max_n)
+{
+  smal_mark_prefetch fifo;
+  void *referrer, *ptr;
+  fifo.head = fifo.n = 0;
+  for (;;) {
+    while ( fifo.n < smal_mark_prefetch_SIZE && smal_mark_queue_pop(&referrer, &ptr) )
+      smal_mark_prefetch_add(&fifo, referrer, ptr);
+    if ( ! fifo.n )
+      return 1;
+    if ( ! max_n -- )
+      break;
+    smal_mark_prefetch_mark(&fifo);
+  }
+  /* Requeue entries not yet marked. */
+  while ( fifo.n ) {
+    int j = fifo.head;
+    fifo.head = (j + 1) & (smal_mark_prefetch_SIZE - 1);
+    -- fifo.n;
+    smal_mark_queue_push(fifo.entries[j].referrer, fifo.entries[j].ptr);
+  }
+  return 0;
+}
+
+#define smal_mark_queue_mark_prefetch() ((void) smal_mark_queue_mark_n((size_t) -1))
+
+#if SMAL_PARALLEL_MARK
+static void smal_parallel_mark();
+#endif
+
+/* Scan up to max_n grey objects left by smal_mark_queue_overflow(); returns 0 if there were none.
+   If drain, drain the mark queue after each object, so rescanning needs no more than one chunk;
+   otherwise queue the pointer returned by each mark_func. */
+static
+int smal_mark_queue_rescan(size_t max_n, int drain)
+{
+  smal_buffer *buf;
+  size_t i;
+
+  if ( ! mark_queue_overflow )
+    return 0;
+  mark_queue_overflow = 0;
+
+  smal_dllist_each(&buffer_collecting, buf); {
+    if ( buf->mark_overflow ) {
+      buf->mark_overflow = 0;
+      for ( i = 0; i < buf->object_capacity; ++ i ) {
+	void *ptr, *next;
+	if ( ! smal_bitmap_w(&buf->grey_bits, i) ) {
+	  i |= smal_BITS_PER_WORD - 1;
+	  continue;
+	}
+	if ( ! smal_bitmap_setQ(&buf->grey_bits, i) )
+	  continue;
+	if ( ! max_n -- ) {
+	  buf->mark_overflow = mark_queue_overflow = 1;
+	  return 1;
+	}
+	smal_bitmap_clr_atomic(&buf->grey_bits, i);
+	ptr = smal_buffer_i_ptr(buf, i);
+	_smal_mark_referrer = 0;
+	next = buf->type->desc.mark_func(ptr);
+	if ( drain ) {
+	  _smal_mark_ptr_tail(ptr, next);
+	  smal_mark_queue_mark_prefetch();
+	} else if ( next ) {
+	  smal_mark_queue_push(ptr, next);
+	}
+      }
+    }
+  } smal_dllist_each_end();
+
+  return 1;
+}
+
 static inline
 void smal_mark_queue_mark_all()
 {
 #if 0
   fprintf(stderr, "  s_m_q_m_a() ");
 #endif
-  smal_mark_queue_mark(0);
+  do {
+#if SMAL_PARALLEL_MARK
+    if ( smal_mark_threads > 1 )
+      smal_parallel_mark();
+    else
+#endif
+      smal_mark_queue_mark_prefetch();
+  } while ( smal_mark_queue_rescan((size_t) -1, 1) );
 #if 0
   fprintf(stderr, " DONE (%lu max depth)\n", (unsigned long) mark_queue_depth_max);
 #endif
@@ -113,30 +412,14 @@ void smal_mark_queue_add(void *referrer, int ptr_n, void **ptrs, int pointers_to
     while ( -- ptr_n >= 0 ) {
       void **ptr_p = *(ptrs ++);
       void *ptr = ptr_p ? *ptr_p : 0;
-      if ( ptr ) {
-	if ( mark_queue->front >= mark_queue->back )
-	  smal_mark_queue_new();
-	*(mark_queue->front ++) = referrer;
-	*(mark_queue->front ++) = ptr;
-#if 0
-	// fprintf(stderr, "%*s q(%p)\n", mark_queue_depth, " ", ptr);
-	if ( mark_queue_depth_max < ++ mark_queue_depth ) mark_queue_depth_max = mark_queue_depth;
-#endif
-      }
+      if ( ptr )
+	smal_mark_queue_push(referrer, ptr);
     }
   } else {
     while ( -- ptr_n >= 0 ) {
       void *ptr = *(ptrs ++);
-      if ( ptr ) {
-	if ( mark_queue->front >= mark_queue->back )
-	  smal_mark_queue_new();
-	*(mark_queue->front ++) = referrer;
-	*(mark_queue->front ++) = ptr;
-#if 0
-	// fprintf(stderr, "%*s q(%p)\n", mark_queue_depth , " ", ptr);
-	if ( mark_queue_depth_max < ++ mark_queue_depth ) mark_queue_depth_max = mark_queue_depth;
-#endif
-      }
+      if ( ptr )
+	smal_mark_queue_push(referrer, ptr);
     }
   }
 #if 0
@@ -0,0 +1,222 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Reserved virtual address arenas for smal_buffer pages.
+
+  An arena reserves smal_arena_size bytes of PROT_NONE address space, aligned to smal_page_size,
+  with a single mmap().  Buffers are carved from it using a free map with one bit per smal_page.
+  Address space is made PROT_READ | PROT_WRITE in smal_arena_COMMIT chunks as the arena grows,
+  so most buffer allocations need no system call.
+  Freed pages are returned to the OS but stay mapped, see smal_arena_decommit().
+
+  Another arena is reserved when all arenas are full; if that fails, buffers are mmap()ed directly.
+*/
+
+#ifndef smal_arena_size_default
+#define smal_arena_size_default ((size_t) 1024 * 1024 * 1024)
+#endif
+
+/* Bytes made writable at a time. */
+#ifndef smal_arena_COMMIT
+#define smal_arena_COMMIT ((size_t) 4 * 1024 * 1024)
+#endif
+
+size_t smal_arena_size = smal_arena_size_default;
+
+typedef struct smal_arena {
+  struct smal_arena *next;
+  void *addr; /** Aligned to smal_page_size. */
+  size_t size;
+  void *commit_end; /** [addr, commit_end) is writable. */
+  size_t page_n;
+  size_t page_hint; /** All pages before page_hint are in use. */
+  smal_bitmap pages_used;
+} smal_arena;
+
+static smal_arena *arena_list;
+static smal_thread_mutex arena_mutex;
+
+static
+smal_arena *smal_arena_new(size_t size)
+{
+  smal_arena *self;
+  void *addr, *aligned;
+  size_t reserve_size;
+
+  size = (size + smal_page_mask) & ~ smal_page_mask;
+  reserve_size = size + smal_page_size;
+  addr = smal_mmap((void*) 0, reserve_size, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, (off_t) 0);
+  if ( addr == MAP_FAILED )
+    return 0;
+
+  /* Trim to alignment once per arena. */
+  aligned = (void*) (((size_t) addr + smal_page_mask) & ~ smal_page_mask);
+  if ( aligned > addr )
+    smal_munmap(addr, aligned - addr);
+  if ( aligned + size < addr + reserve_size )
+    smal_munmap(aligned + size, (addr + reserve_size) - (aligned + size));
+
+  self = malloc(sizeof(*self));
+  malloc_overhead_size += sizeof(*self);
+  memset(self, 0, sizeof(*self));
+  self->addr = self->commit_end = aligned;
+  self->size = size;
+  self->pages_used.size = self->page_n = size / smal_page_size;
+  if ( smal_bitmap_init(&self->pages_used) < 0 ) {
+    smal_munmap(aligned, size);
+    free(self);
+    malloc_overhead_size -= sizeof(*self);
+    return 0;
+  }
+
+  smal_debug(mmap, 2, "arena @%p[0x%lx]", self->addr, (unsigned long) self->size);
+
+  self->next = arena_list;
+  arena_list = self;
+  return self;
+}
+
+/* Make [addr, addr + size) writable.  Assumes arena_mutex is locked. */
+static
+int smal_arena_commit(smal_arena *self, void *addr, size_t size)
+{
+  void *end = addr + size;
+  if ( end > self->commit_end ) {
+    size_t commit_size = end - self->commit_end;
+    if ( commit_size < smal_arena_COMMIT )
+      commit_size = smal_arena_COMMIT;
+    if ( commit_size > (self->addr + self->size) - self->commit_end )
+      commit_size = (self->addr + self->size) - self->commit_end;
+    if ( mprotect(self->commit_end, commit_size, PROT_READ | PROT_WRITE) )
+      return -1;
+#ifdef MADV_HUGEPAGE
+    if ( smal_page_size >= smal_huge_page_size )
+      madvise(self->commit_end, commit_size, MADV_HUGEPAGE);
+#endif
+    self->commit_end += commit_size;
+  }
+  return 0;
+}
+
+/* Return pages to the OS; they will read as zero when touched again. */
+static
+void smal_arena_decommit(void *addr, size_t size)
+{
+#if defined(__linux__) && defined(MADV_DONTNEED)
+  madvise(addr, size, MADV_DONTNEED);
+#if SMAL_BUFFER_WRITE_BARRIER
+  /* The buffer may have been left write-protected. */
+  mprotect(addr, size, PROT_READ | PROT_WRITE);
+#endif
+#else
+  smal_mmap(addr, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, (off_t) 0);
+#endif
+}
+
+/* Find page_n free pages in an arena.  Assumes arena_mutex is locked. */
+static
+void *smal_arena_alloc_pages(smal_arena *self, size_t page_n)
+{
+  smal_bitmap *bm = &self->pages_used;
+  size_t i, run_i = 0, run_n = 0;
+  void *addr;
+
+  for ( i = self->page_hint; i < self->page_n; ++ i ) {
+    /* Skip full words. */
+    if ( ! run_n && ! (i % smal_BITS_PER_WORD) && smal_bitmap_w(bm, i) == ~ 0U ) {
+      i += smal_BITS_PER_WORD - 1;
+      continue;
+    }
+    if ( smal_bitmap_setQ(bm, i) ) {
+      run_n = 0;
+    } else {
+      if ( ! run_n ++ )
+	run_i = i;
+      if ( run_n == page_n )
+	goto found;
+    }
+  }
+  return 0;
+
+ found:
+  addr = self->addr + run_i * smal_page_size;
+  if ( smal_arena_commit(self, addr, page_n * smal_page_size) < 0 )
+    return 0;
+  for ( i = run_i; i < run_i + page_n; ++ i )
+    smal_bitmap_set(bm, i);
+  if ( run_i == self->page_hint )
+    self->page_hint = run_i + page_n;
+  return addr;
+}
+
+/* Returns an aligned, zeroed region of size bytes, or 0. */
+static
+void *smal_arena_alloc(size_t size)
+{
+  smal_arena *arena;
+  size_t page_n = size / smal_page_size;
+  void *addr = 0;
+
+  if ( ! smal_arena_size || smal_page_hugetlb )
+    return 0;
+
+  smal_thread_mutex_lock(&arena_mutex);
+  for ( arena = arena_list; arena; arena = arena->next ) {
+    if ( (addr = smal_arena_alloc_pages(arena, page_n)) )
+      goto done;
+  }
+  if ( (arena = smal_arena_new(size > smal_arena_size ? size : smal_arena_size)) )
+    addr = smal_arena_alloc_pages(arena, page_n);
+ done:
+  smal_thread_mutex_unlock(&arena_mutex);
+
+  smal_debug(mmap, 3, "(0x%lx) = @%p", (unsigned long) size, addr);
+  return addr;
+}
+
+/* Returns 0 if [addr, addr + size) is not from an arena. */
+static
+int smal_arena_free(void *addr, size_t size)
+{
+  smal_arena *arena;
+  int result = 0;
+
+  smal_thread_mutex_lock(&arena_mutex);
+  for ( arena = arena_list; arena; arena = arena->next ) {
+    if ( arena->addr <= addr && addr < arena->addr + arena->size ) {
+      size_t i = (addr - arena->addr) / smal_page_size, end = i + size / smal_page_size;
+      smal_arena_decommit(addr, size);
+      if ( arena->page_hint > i )
+	arena->page_hint = i;
+      for ( ; i < end; ++ i ) {
+	assert(smal_bitmap_setQ(&arena->pages_used, i));
+	smal_bitmap_clr(&arena->pages_used, i);
+      }
+      result = 1;
+      break;
+    }
+  }
+  smal_thread_mutex_unlock(&arena_mutex);
+
+  return result;
+}
+
+/* Release all arenas: only during smal_shutdown(). */
+static
+void smal_arena_free_all()
+{
+  smal_arena *arena;
+  while ( (arena = arena_list) ) {
+    arena_list = arena->next;
+    smal_munmap(arena->addr, arena->size);
+    smal_bitmap_free(&arena->pages_used);
+    free(arena);
+    malloc_overhead_size -= sizeof(*arena);
+  }
+}
+
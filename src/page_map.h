@@ -0,0 +1,171 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Included directly into smal.c */
+
+/*
+  Two-level radix map from page_id to smal_buffer*.
+
+  The page_id bits of a user-space address are split in half:
+  the high half indexes page_map_root, the low half indexes a leaf of smal_buffer* entries.
+  The root and leaves are mmap()ed, so only the entries touched are backed by memory.
+
+  smal_page_map_get() takes no locks: an entry is a single pointer store and
+  a leaf is published only after it is initialized.
+  smal_page_map_add() and smal_page_map_remove() touch only the leaves of the buffer's pages,
+  under page_map_mutex.  Leaves are allocated on demand; a leaf left empty is unlinked,
+  retired and freed by smal_page_map_reclaim() once no reader can still hold it, see epoch.h.
+  Readers outside of smal_collect() must be within smal_epoch_enter() and smal_epoch_exit().
+*/
+
+/* Bits of a user-space address. */
+#ifndef smal_page_map_ADDR_BITS
+#define smal_page_map_ADDR_BITS (sizeof(void*) == 8 ? 48 : 32)
+#endif
+
+typedef struct smal_page_map_leaf {
+  size_t used_n; /** Number of non-zero entries. */
+  struct smal_page_map_leaf *retired_next;
+  size_t retired_epoch;
+  smal_buffer *buffers[0];
+} smal_page_map_leaf;
+
+static smal_page_map_leaf **page_map_root;
+static size_t page_map_root_n;
+static int page_map_leaf_bits;
+static size_t page_map_leaf_mask;
+static smal_page_map_leaf *page_map_retired;
+static smal_thread_mutex page_map_mutex;
+
+/* Bounds of all page_ids ever added; never shrinks. */
+static size_t page_id_min, page_id_max;
+
+#define smal_page_map_leaf_SIZE \
+  (sizeof(smal_page_map_leaf) + sizeof(smal_buffer*) * (page_map_leaf_mask + 1))
+
+static inline
+smal_buffer *smal_page_map_get(size_t page_id)
+{
+  size_t i = page_id >> page_map_leaf_bits;
+  smal_page_map_leaf *leaf;
+  if ( smal_unlikely(i >= page_map_root_n) || smal_unlikely(! (leaf = page_map_root[i])) )
+    return 0;
+  return leaf->buffers[page_id & page_map_leaf_mask];
+}
+
+/* Returns the smal_buffer* whose pages contain PTR, or 0. */
+#define smal_ptr_to_buffer(PTR) smal_page_map_get(smal_addr_page_id(PTR))
+
+static
+void smal_page_map_init()
+{
+  int bits = smal_page_map_ADDR_BITS - smal_page_shift;
+  page_map_leaf_bits = bits / 2;
+  page_map_leaf_mask = ((size_t) 1 << page_map_leaf_bits) - 1;
+  page_map_root_n = (size_t) 1 << (bits - page_map_leaf_bits);
+  page_map_root = smal_mmap((void*) 0, sizeof(page_map_root[0]) * page_map_root_n, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+  if ( page_map_root == MAP_FAILED )
+    abort();
+  page_id_min = page_id_max = 0;
+  smal_thread_mutex_init(&page_map_mutex);
+}
+
+/* Free retired leaves that no reader can still hold. */
+static
+void smal_page_map_reclaim()
+{
+  smal_page_map_leaf **lp, *leaf;
+  size_t safe;
+
+  if ( ! page_map_retired ) return;
+  safe = smal_epoch_safe();
+
+  smal_thread_mutex_lock(&page_map_mutex);
+  for ( lp = &page_map_retired; (leaf = *lp); ) {
+    if ( leaf->retired_epoch < safe ) {
+      *lp = leaf->retired_next;
+      smal_munmap(leaf, smal_page_map_leaf_SIZE);
+    } else {
+      lp = &leaf->retired_next;
+    }
+  }
+  smal_thread_mutex_unlock(&page_map_mutex);
+}
+
+static
+void smal_page_map_add(smal_buffer *self)
+{
+  size_t page_id;
+
+  smal_thread_mutex_lock(&page_map_mutex);
+
+  for ( page_id = smal_buffer_page_id(self); page_id <= smal_buffer_page_id_last(self); ++ page_id ) {
+    size_t i = page_id >> page_map_leaf_bits;
+    smal_page_map_leaf *leaf;
+    assert(i < page_map_root_n);
+    if ( smal_unlikely(! (leaf = page_map_root[i])) ) {
+      leaf = smal_mmap((void*) 0, smal_page_map_leaf_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+      if ( leaf == MAP_FAILED )
+	abort();
+      /* Publish leaf after it is initialized. */
+      __sync_synchronize();
+      page_map_root[i] = leaf;
+    }
+    assert(! leaf->buffers[page_id & page_map_leaf_mask]);
+    leaf->buffers[page_id & page_map_leaf_mask] = self;
+    ++ leaf->used_n;
+  }
+
+  if ( ! page_id_min || page_id_min > smal_buffer_page_id(self) )
+    page_id_min = smal_buffer_page_id(self);
+  if ( page_id_max < smal_buffer_page_id_last(self) )
+    page_id_max = smal_buffer_page_id_last(self);
+
+  smal_thread_mutex_unlock(&page_map_mutex);
+}
+
+static
+void smal_page_map_remove(smal_buffer *self)
+{
+  size_t page_id;
+
+  smal_thread_mutex_lock(&page_map_mutex);
+
+  for ( page_id = smal_buffer_page_id(self); page_id <= smal_buffer_page_id_last(self); ++ page_id ) {
+    size_t i = page_id >> page_map_leaf_bits;
+    smal_page_map_leaf *leaf = page_map_root[i];
+    assert(leaf && leaf->buffers[page_id & page_map_leaf_mask] == self);
+    leaf->buffers[page_id & page_map_leaf_mask] = 0;
+    if ( -- leaf->used_n == 0 ) {
+      page_map_root[i] = 0;
+      leaf->retired_epoch = smal_epoch_retire();
+      leaf->retired_next = page_map_retired;
+      page_map_retired = leaf;
+    }
+  }
+
+  smal_thread_mutex_unlock(&page_map_mutex);
+}
+
+/* Only during smal_shutdown(). */
+static
+void smal_page_map_free()
+{
+  size_t i;
+  smal_page_map_leaf *leaf;
+  while ( (leaf = page_map_retired) ) {
+    page_map_retired = leaf->retired_next;
+    smal_munmap(leaf, smal_page_map_leaf_SIZE);
+  }
+  for ( i = 0; i < page_map_root_n; ++ i ) {
+    if ( page_map_root[i] )
+      smal_munmap(page_map_root[i], smal_page_map_leaf_SIZE);
+  }
+  smal_munmap(page_map_root, sizeof(page_map_root[0]) * page_map_root_n);
+  page_map_root = 0;
+  page_map_root_n = 0;
+  smal_thread_mutex_destroy(&page_map_mutex);
+}
+
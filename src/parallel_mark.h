@@ -0,0 +1,310 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Parallel marking with work-stealing.
+
+  smal_mark_queue_mark_all() marks with smal_mark_threads markers:
+  the collecting thread and a pool of marker threads started on demand.
+  smal_collect_mark_roots() still runs only on the collecting thread;
+  the entries it queued are dealt round-robin into each marker's deque.
+
+  Each marker pushes to and pops from its own thread-local mark_queue.
+  Periodically, when its deque is empty, it moves half of its mark_queue into its deque,
+  where idle markers can steal from.  The deque is a bounded Chase-Lev deque:
+  the owner pushes and pops at bottom, thieves take from top with compare-and-swap.
+
+  A marker with no work increments mark_idle_n.
+  Marking is done when every marker is idle: only a marker that is not idle can create work.
+
+  While marking in parallel, mark bits are set with an atomic fetch-or; see smal_buffer_mark_test_set().
+*/
+
+#include <sched.h> /* sched_yield() */
+
+#ifndef smal_mark_deque_SIZE
+#define smal_mark_deque_SIZE 4096 /* Must be a power of 2. */
+#endif
+
+/* Number of objects marked between sharing checks. */
+#ifndef smal_mark_share_INTERVAL
+#define smal_mark_share_INTERVAL 64
+#endif
+
+typedef struct smal_mark_entry {
+  void *referrer, *ptr;
+} smal_mark_entry;
+
+typedef struct smal_mark_deque {
+  volatile size_t top; /** Next entry to steal. */
+  char _pad[64 - sizeof(size_t)]; /* Keep thieves off the owner's cache line. */
+  volatile size_t bottom; /** Next entry to push. */
+  /* Read racily by thieves; volatile also keeps copies out of vector registers,
+     which would be scanned conservatively by the next smal_collect(). */
+  volatile smal_mark_entry entries[smal_mark_deque_SIZE];
+} smal_mark_deque;
+
+typedef struct smal_mark_worker {
+  smal_mark_deque deque;
+  pthread_t thread;
+  size_t phase; /** Last mark_phase run. */
+  unsigned int seed; /** For choosing victims. */
+} smal_mark_worker;
+
+int smal_mark_threads = 1;
+
+static int mark_parallel; /** True while markers run. */
+static smal_mark_worker *mark_workers; /** mark_workers[0] is the collecting thread. */
+static int mark_workers_n;
+static volatile int mark_idle_n;
+static pthread_mutex_t mark_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mark_workers_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mark_workers_done_cond = PTHREAD_COND_INITIALIZER;
+static size_t mark_phase;
+static int mark_workers_busy; /** Marker threads still in mark_phase. */
+static int mark_workers_exit;
+
+#define smal_mark_deque_get(D, I, EP)					\
+  do {									\
+    volatile smal_mark_entry *_e = &(D)->entries[(I) & (smal_mark_deque_SIZE - 1)]; \
+    (EP)->referrer = _e->referrer;					\
+    (EP)->ptr = _e->ptr;						\
+  } while ( 0 )
+
+/* Owner only; returns 0 if full. */
+static inline
+int smal_mark_deque_push(smal_mark_deque *self, void *referrer, void *ptr)
+{
+  size_t b = self->bottom;
+  volatile smal_mark_entry *e;
+  if ( b - self->top >= smal_mark_deque_SIZE )
+    return 0;
+  e = &self->entries[b & (smal_mark_deque_SIZE - 1)];
+  e->referrer = referrer;
+  e->ptr = ptr;
+  __sync_synchronize();
+  self->bottom = b + 1;
+  return 1;
+}
+
+/* Owner only; returns 0 if empty. */
+static inline
+int smal_mark_deque_pop(smal_mark_deque *self, smal_mark_entry *ep)
+{
+  size_t b = self->bottom, t;
+  if ( b == self->top )
+    return 0;
+  self->bottom = -- b;
+  __sync_synchronize();
+  t = self->top;
+  if ( (ssize_t) (b - t) < 0 ) {
+    self->bottom = b + 1;
+    return 0;
+  }
+  smal_mark_deque_get(self, b, ep);
+  if ( b == t ) {
+    /* Last entry: race thieves for it. */
+    int won = __sync_bool_compare_and_swap(&self->top, t, t + 1);
+    self->bottom = b + 1;
+    return won;
+  }
+  return 1;
+}
+
+/* Any thread; returns 0 if empty or lost a race. */
+static inline
+int smal_mark_deque_steal(smal_mark_deque *self, smal_mark_entry *ep)
+{
+  size_t t = self->top, b;
+  __sync_synchronize();
+  b = self->bottom;
+  if ( (ssize_t) (b - t) <= 0 )
+    return 0;
+  smal_mark_deque_get(self, t, ep);
+  return __sync_bool_compare_and_swap(&self->top, t, t + 1);
+}
+
+#define smal_mark_deque_emptyQ(D) ((ssize_t) ((D)->bottom - (D)->top) <= 0)
+
+/* Move half of this marker's mark_queue into its deque, if it is empty. */
+static inline
+void smal_mark_worker_share(smal_mark_worker *self)
+{
+  size_t n = 0, i;
+  smal_mark_queue *q;
+  void *referrer, *ptr;
+
+  if ( ! smal_mark_deque_emptyQ(&self->deque) )
+    return;
+  for ( q = mark_queue; q && n < smal_mark_deque_SIZE; q = q->prev )
+    n += (q->front - q->ptrs) / 2;
+  for ( i = n / 2; i > 0 && smal_mark_queue_pop(&referrer, &ptr); -- i ) {
+    if ( ! smal_mark_deque_push(&self->deque, referrer, ptr) ) {
+      smal_mark_queue_add(referrer, 1, &ptr, 0);
+      break;
+    }
+  }
+}
+
+static inline
+int smal_mark_worker_steal(smal_mark_worker *self, smal_mark_entry *ep)
+{
+  int i, victim;
+  self->seed = self->seed * 1103515245 + 12345;
+  victim = (self->seed >> 16) % mark_workers_n;
+  for ( i = 0; i < mark_workers_n; ++ i, victim = (victim + 1) % mark_workers_n ) {
+    if ( mark_workers + victim != self && smal_mark_deque_steal(&mark_workers[victim].deque, ep) )
+      return 1;
+  }
+  return 0;
+}
+
+/* Returns 1 when all markers are idle, 0 if there may be work to steal. */
+static
+int smal_mark_worker_idle(smal_mark_worker *self)
+{
+  __sync_add_and_fetch(&mark_idle_n, 1);
+  for (;;) {
+    int i;
+    if ( mark_idle_n == mark_workers_n )
+      return 1;
+    for ( i = 0; i < mark_workers_n; ++ i ) {
+      if ( ! smal_mark_deque_emptyQ(&mark_workers[i].deque) ) {
+	__sync_sub_and_fetch(&mark_idle_n, 1);
+	return 0;
+      }
+    }
+    sched_yield();
+  }
+}
+
+static
+void smal_mark_worker_run(smal_mark_worker *self)
+{
+  size_t n = 0;
+  smal_mark_entry e;
+  smal_mark_prefetch fifo;
+
+  if ( ! mark_queue )
+    smal_mark_queue_new(1);
+  fifo.head = fifo.n = 0;
+
+  for (;;) {
+    while ( fifo.n < smal_mark_prefetch_SIZE && smal_mark_queue_pop(&e.referrer, &e.ptr) ) {
+      smal_mark_prefetch_add(&fifo, e.referrer, e.ptr);
+      if ( ++ n % smal_mark_share_INTERVAL == 0 )
+	smal_mark_worker_share(self);
+    }
+    if ( fifo.n ) {
+      smal_mark_prefetch_mark(&fifo);
+    } else if ( smal_mark_deque_pop(&self->deque, &e) ||
+		smal_mark_worker_steal(self, &e) ) {
+      smal_mark_prefetch_add(&fifo, e.referrer, e.ptr);
+    } else if ( smal_mark_worker_idle(self) ) {
+      break;
+    }
+  }
+}
+
+static
+void *smal_mark_worker_main(void *arg)
+{
+  smal_mark_worker *self = arg;
+
+  pthread_mutex_lock(&mark_workers_mutex);
+  for (;;) {
+    while ( self->phase == mark_phase && ! mark_workers_exit )
+      pthread_cond_wait(&mark_workers_start_cond, &mark_workers_mutex);
+    if ( mark_workers_exit )
+      break;
+    self->phase = mark_phase;
+    pthread_mutex_unlock(&mark_workers_mutex);
+
+    smal_mark_worker_run(self);
+
+    pthread_mutex_lock(&mark_workers_mutex);
+    if ( -- mark_workers_busy == 0 )
+      pthread_cond_signal(&mark_workers_done_cond);
+  }
+  pthread_mutex_unlock(&mark_workers_mutex);
+
+  smal_mark_queue_free();
+  return 0;
+}
+
+static
+void smal_mark_workers_stop()
+{
+  int i;
+  if ( ! mark_workers )
+    return;
+  pthread_mutex_lock(&mark_workers_mutex);
+  mark_workers_exit = 1;
+  pthread_cond_broadcast(&mark_workers_start_cond);
+  pthread_mutex_unlock(&mark_workers_mutex);
+  for ( i = 1; i < mark_workers_n; ++ i )
+    pthread_join(mark_workers[i].thread, 0);
+  free(mark_workers);
+  malloc_overhead_size -= sizeof(mark_workers[0]) * mark_workers_n;
+  mark_workers = 0;
+  mark_workers_n = 0;
+  mark_workers_exit = 0;
+}
+
+static
+void smal_mark_workers_start(int n)
+{
+  int i;
+  if ( posix_memalign((void**) &mark_workers, 64, sizeof(mark_workers[0]) * n) )
+    abort();
+  malloc_overhead_size += sizeof(mark_workers[0]) * n;
+  memset(mark_workers, 0, sizeof(mark_workers[0]) * n);
+  mark_workers_n = n;
+  for ( i = 0; i < n; ++ i ) {
+    mark_workers[i].phase = mark_phase;
+    mark_workers[i].seed = i + 1;
+  }
+  for ( i = 1; i < n; ++ i )
+    smal_assert(pthread_create(&mark_workers[i].thread, 0, smal_mark_worker_main, &mark_workers[i]), == 0);
+}
+
+static
+void smal_parallel_mark()
+{
+  void *referrer, *ptr;
+  int i;
+
+  if ( mark_workers_n != smal_mark_threads ) {
+    smal_mark_workers_stop();
+    smal_mark_workers_start(smal_mark_threads);
+  }
+
+  /* Seed each deque from the roots; the rest stay in this thread's mark_queue. */
+  for ( i = 0; smal_mark_queue_pop(&referrer, &ptr); i = (i + 1) % mark_workers_n ) {
+    if ( ! smal_mark_deque_push(&mark_workers[i].deque, referrer, ptr) ) {
+      smal_mark_queue_add(referrer, 1, &ptr, 0);
+      break;
+    }
+  }
+
+  mark_parallel = 1;
+  mark_idle_n = 0;
+  pthread_mutex_lock(&mark_workers_mutex);
+  mark_workers_busy = mark_workers_n - 1;
+  ++ mark_phase;
+  pthread_cond_broadcast(&mark_workers_start_cond);
+  pthread_mutex_unlock(&mark_workers_mutex);
+
+  smal_mark_worker_run(&mark_workers[0]);
+
+  pthread_mutex_lock(&mark_workers_mutex);
+  while ( mark_workers_busy )
+    pthread_cond_wait(&mark_workers_done_cond, &mark_workers_mutex);
+  pthread_mutex_unlock(&mark_workers_mutex);
+  mark_parallel = 0;
+}
+
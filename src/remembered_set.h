@@ -7,14 +7,31 @@
 
 #include "hash/voidP_Table.h"
 
+/*
+  A buffer has a remembered set per slice, see buffer_write_barrier.h,
+  holding the references of the objects starting in that slice to other buffers.
+  Without slices, a buffer has one remembered set.
+*/
+
 typedef struct smal_remembered_set {
   voidP_Table ptr_table;
   int ptrs_valid;
   void **ptrs;
   size_t n_ptrs;
   smal_buffer *buf;
+  smal_thread_mutex ptr_table_mutex; /** smal_remembered_set_add() is called by parallel markers. */
+  int valid; /** If true, ptrs are all the references of this set's objects to other buffers. */
+  int record; /** If true, marking adds the references of this set's objects. */
 } smal_remembered_set;
 
+#if SMAL_WRITE_BARRIER_SLICES
+#define smal_buffer_remembered_set_n(BUF) ((BUF)->slice_dirty ? (BUF)->slice_n : 1)
+#define smal_buffer_remembered_set_i(BUF, PTR) ((BUF)->slice_dirty ? smal_buffer_slice_i(BUF, PTR) : 0)
+#else
+#define smal_buffer_remembered_set_n(BUF) 1
+#define smal_buffer_remembered_set_i(BUF, PTR) 0
+#endif
+
 static inline
 void 
 smal_remembered_set_init(smal_remembered_set *self, smal_buffer *buf)
@@ -22,18 +39,22 @@ smal_remembered_set_init(smal_remembered_set *self, smal_buffer *buf)
   self->buf = buf;
   smal_debug(remembered_set, 2, " b@%p init", self->buf);
   voidP_TableInit(&self->ptr_table, 101);
+  smal_thread_mutex_init(&self->ptr_table_mutex);
   self->ptrs_valid = 0;
   self->ptrs = 0;
   self->n_ptrs = 0;
 }
 
+/* Returns n remembered sets. */
 static inline
 smal_remembered_set *
-smal_remembered_set_new(smal_buffer *buf)
+smal_remembered_set_new(smal_buffer *buf, size_t n)
 {
-  smal_remembered_set *self = malloc(sizeof(*self));
-  memset(self, 0, sizeof(*self));
-  smal_remembered_set_init(self, buf);
+  smal_remembered_set *self = malloc(sizeof(*self) * n);
+  size_t i;
+  memset(self, 0, sizeof(*self) * n);
+  for ( i = 0; i < n; ++ i )
+    smal_remembered_set_init(self + i, buf);
   return self;
 }
 
@@ -43,6 +64,7 @@ smal_remembered_set_destroy(smal_remembered_set *self)
 {
   smal_debug(remembered_set, 2, " b@%p destroy", self->buf);
   voidP_TableDestroy(&self->ptr_table);
+  smal_thread_mutex_destroy(&self->ptr_table_mutex);
   if ( self->ptrs )
     free(self->ptrs);
   self->buf = 0;
@@ -50,10 +72,12 @@ smal_remembered_set_destroy(smal_remembered_set *self)
 
 static inline
 void 
-smal_remembered_set_free(smal_remembered_set *self)
+smal_remembered_set_free(smal_remembered_set *self, size_t n)
 {
+  size_t i;
   if ( ! self ) return;
-  smal_remembered_set_destroy(self);
+  for ( i = 0; i < n; ++ i )
+    smal_remembered_set_destroy(self + i);
   free(self);
 }
 
@@ -69,7 +93,11 @@ smal_remembered_set_clear(smal_remembered_set *self)
 static inline
 void smal_remembered_set_add(smal_remembered_set *self, void *referrer, void *ptr)
 {
-  if ( voidP_TableAdd(&self->ptr_table, ptr) )  {
+  int added;
+  smal_thread_mutex_lock(&self->ptr_table_mutex);
+  added = voidP_TableAdd(&self->ptr_table, ptr) != 0;
+  smal_thread_mutex_unlock(&self->ptr_table_mutex);
+  if ( added )  {
     smal_debug(remembered_set, 4, " b@%p @%p -> @%p", self->buf, referrer, ptr); 
   } else {
     smal_debug(remembered_set, 9, " b@%p @%p X> @%p", self->buf, referrer, ptr); 
@@ -111,3 +139,29 @@ void smal_remembered_set_mark(smal_remembered_set *self)
   smal_debug(remembered_set, 3, " b@%p mark %d", self->buf, (int) self->n_ptrs);
   smal_mark_ptr_n(0, self->n_ptrs, self->ptrs);
 }
+
+/* Mark the valid remembered sets of buf. */
+static inline
+void smal_buffer_remembered_set_mark(smal_buffer *buf)
+{
+  size_t i, n = smal_buffer_remembered_set_n(buf);
+  for ( i = 0; i < n; ++ i ) {
+    if ( buf->remembered_set[i].valid )
+      smal_remembered_set_mark(buf->remembered_set + i);
+  }
+}
+
+/* Finish the recorded remembered sets of buf and mark them valid. */
+static inline
+void smal_buffer_remembered_set_finish(smal_buffer *buf)
+{
+  size_t i, n = smal_buffer_remembered_set_n(buf);
+  for ( i = 0; i < n; ++ i ) {
+    smal_remembered_set *rs = buf->remembered_set + i;
+    if ( rs->record ) {
+      rs->record = 0;
+      smal_remembered_set_finish(rs);
+      rs->valid = 1;
+    }
+  }
+}
@@ -0,0 +1,166 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Size classes for smal_alloc_size() and smal_realloc().
+
+  Sizes up to 128 bytes are rounded up to a multiple of 8.
+  Larger sizes are rounded up to one of 4 steps per power of 2,
+  bounding internal fragmentation to 25%.
+
+  Each size class keeps a list of smal_types, one per (mark_func, free_func) pair.
+  The list is only prepended to under size_class_mutex; lookups do not lock.
+
+  Sizes larger than a single page smal_buffer can hold are rounded up to fill
+  a whole large object span, see smal_buffer_span_size().
+*/
+
+#define smal_size_class_SIZE_MAX smal_buffer_object_size_MAX
+
+#define smal_size_class_SMALL_MAX 128
+#define smal_size_class_SMALL_N (smal_size_class_SMALL_MAX / 8)
+#define smal_size_class_N 128 /* up to 1GiB smal_page_size. */
+
+typedef struct smal_size_class_type {
+  smal_mark_func mark_func;
+  smal_free_func free_func;
+  smal_type *type;
+  struct smal_size_class_type *next;
+} smal_size_class_type;
+
+static smal_size_class_type *size_class_types[smal_size_class_N];
+static smal_thread_mutex size_class_mutex;
+
+/* Returns the size class index for size or -1 for a large object. */
+static inline
+int smal_size_class_index(size_t size)
+{
+  int lg;
+  if ( smal_likely(size <= smal_size_class_SMALL_MAX) )
+    return size ? (size + 7) / 8 - 1 : 0;
+  if ( smal_unlikely(size > smal_size_class_SIZE_MAX) )
+    return -1;
+  lg = sizeof(long) * 8 - 1 - __builtin_clzl(size - 1);
+  return smal_size_class_SMALL_N + (lg - 7) * 4 + (((size - 1) >> (lg - 2)) & 3);
+}
+
+static inline
+size_t smal_size_class_size(int i)
+{
+  size_t size;
+  int lg;
+  if ( i < smal_size_class_SMALL_N )
+    return (i + 1) * 8;
+  i -= smal_size_class_SMALL_N;
+  lg = 7 + i / 4;
+  size = ((size_t) (4 + i % 4 + 1)) << (lg - 2);
+  return size > smal_size_class_SIZE_MAX ? smal_size_class_SIZE_MAX : size;
+}
+
+static
+smal_type *smal_size_class_type_for(int i, smal_mark_func mark_func, smal_free_func free_func)
+{
+  smal_size_class_type *t;
+
+  for ( t = size_class_types[i]; t; t = t->next )
+    if ( t->mark_func == mark_func && t->free_func == free_func )
+      return t->type;
+
+  smal_thread_mutex_lock(&size_class_mutex);
+  for ( t = size_class_types[i]; t; t = t->next )
+    if ( t->mark_func == mark_func && t->free_func == free_func )
+      break;
+  if ( ! t ) {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = smal_size_class_size(i);
+    desc.mark_func = mark_func;
+    desc.free_func = free_func;
+
+    t = malloc(sizeof(*t));
+    malloc_overhead_size += sizeof(*t);
+    t->mark_func = mark_func;
+    t->free_func = free_func;
+    t->type = smal_type_for_desc(&desc);
+    t->next = size_class_types[i];
+    /* Publish t after it is initialized. */
+    __sync_synchronize();
+    size_class_types[i] = t;
+  }
+  smal_thread_mutex_unlock(&size_class_mutex);
+
+  return t->type;
+}
+
+static
+void smal_size_class_free_all()
+{
+  smal_size_class_type *t;
+  int i;
+  for ( i = 0; i < smal_size_class_N; ++ i ) {
+    while ( (t = size_class_types[i]) ) {
+      size_class_types[i] = t->next;
+      free(t);
+      malloc_overhead_size -= sizeof(*t);
+    }
+  }
+}
+
+/* Object size of a large object: all of its span. */
+static inline
+size_t smal_size_class_large_size(size_t size)
+{
+  return smal_buffer_span_size(size, sizeof(double)) - smal_buffer_HEADER_SIZE - sizeof(double);
+}
+
+static
+smal_type *smal_size_class_large_type_for(size_t size, smal_mark_func mark_func, smal_free_func free_func)
+{
+  smal_type_descriptor desc;
+  memset(&desc, 0, sizeof(desc));
+  desc.object_size = smal_size_class_large_size(size);
+  desc.mark_func = mark_func;
+  desc.free_func = free_func;
+  return smal_type_for_desc(&desc);
+}
+
+void *smal_alloc_size(size_t size, smal_mark_func mark_func, smal_free_func free_func)
+{
+  int i;
+  if ( smal_unlikely(! initialized) ) smal_init();
+  if ( smal_unlikely((i = smal_size_class_index(size)) < 0) )
+    return smal_alloc(smal_size_class_large_type_for(size, mark_func, free_func));
+  return smal_alloc(smal_size_class_type_for(i, mark_func, free_func));
+}
+
+void *smal_realloc(void *ptr, size_t size)
+{
+  smal_buffer *buf;
+  void *new_ptr;
+  size_t old_size;
+
+  if ( smal_unlikely(! (buf = smal_buffer_from_ptr(ptr))) )
+    abort();
+
+  old_size = smal_buffer_object_size(buf);
+  if ( smal_size_class_index(size) < 0 ?
+       smal_size_class_large_size(size) == old_size :
+       smal_size_class_index(size) == smal_size_class_index(old_size) )
+    return ptr;
+
+  if ( smal_unlikely(! (new_ptr = smal_alloc_size(size, buf->type->desc.mark_func, buf->type->desc.free_func))) )
+    return 0;
+  memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+
+  /* The contents now belong to new_ptr: do not call free_func on ptr. */
+  smal_thread_rwlock_rdlock(&alloc_lock);
+  _smal_buffer_free_object(buf, ptr, 0);
+  smal_thread_rwlock_unlock(&alloc_lock);
+
+  return new_ptr;
+}
+
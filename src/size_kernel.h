@@ -0,0 +1,55 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Size-specialized kernels.
+
+  For each SIZE in SMAL_SIZE_KERNEL_SIZES(), the object sweep and allocation routines are
+  instantiated with a constant object_size, so their strides and divisors are compile-time constants.
+  smal_type_for_desc() selects a smal_type's kernel by its aligned desc.object_size;
+  types of other sizes use the generic routines.
+
+  Marking does not dispatch through kernels: an indirect call per object would cost
+  more than smal_buffer_ptr_i()'s multiply.
+*/
+
+typedef struct smal_size_kernel {
+  size_t object_size;
+  size_t (*sweep_objects)(smal_buffer *self, void *alloc_ptr);
+  size_t (*alloc_objects)(smal_buffer *self, size_t max_n, void **free_listp, void **run_ptrp);
+} smal_size_kernel;
+
+#define smal_size_kernel_DEFINE(SIZE)					\
+  static size_t smal_buffer_sweep_objects_##SIZE(smal_buffer *self, void *alloc_ptr) \
+  {									\
+    return _smal_buffer_sweep_objects(self, alloc_ptr, SIZE);		\
+  }									\
+  static size_t smal_buffer_alloc_objects_##SIZE(smal_buffer *self, size_t max_n, void **free_listp, void **run_ptrp) \
+  {									\
+    return _smal_buffer_alloc_objects(self, max_n, free_listp, run_ptrp, SIZE); \
+  }
+
+SMAL_SIZE_KERNEL_SIZES(smal_size_kernel_DEFINE)
+
+#define smal_size_kernel_ENTRY(SIZE)					\
+  { SIZE, smal_buffer_sweep_objects_##SIZE, smal_buffer_alloc_objects_##SIZE },
+
+static const smal_size_kernel smal_size_kernels[] = {
+  SMAL_SIZE_KERNEL_SIZES(smal_size_kernel_ENTRY)
+  { 0 }
+};
+
+static
+const smal_size_kernel *smal_size_kernel_for(size_t object_size)
+{
+  const smal_size_kernel *k;
+  for ( k = smal_size_kernels; k->object_size; ++ k ) {
+    if ( k->object_size == object_size )
+      return k;
+  }
+  return 0;
+}
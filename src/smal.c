@@ -37,6 +37,14 @@ size_t _smal_page_mask = smal_page_mask;
 #else
 size_t smal_page_mask = smal_page_size_default - 1;
 #endif
+#ifndef smal_page_shift
+int smal_page_shift = __builtin_ctzl(smal_page_size_default);
+#endif
+size_t smal_page_size_init;
+int smal_page_hugetlb;
+
+/* Huge page size assumed for MAP_HUGETLB and MADV_HUGEPAGE. */
+#define smal_huge_page_size ((size_t) 2 * 1024 * 1024)
 
 /*********************************************************************
  * Debugging support.
@@ -58,6 +66,11 @@ const char *smal_stats_names[] = {
   "mmap_total",
   "malloc_overhead_size",
   "buffer_mutations",
+  "slice_mutations",
+  "write_barrier_disables",
+  "write_barrier_enables",
+  "retained_size",
+  "decommitted_size",
   0
 };
 
@@ -210,6 +223,9 @@ void smal_bitmap_free(smal_bitmap *self)
       (bm)->clr_n ++;				\
     }						\
   } while ( 0 )
+/* Atomic versions: return the old word; do not maintain counts. */
+#define smal_bitmap_set_atomic(bm, i) __sync_fetch_and_or(&smal_bitmap_w(bm, i), smal_bitmap_b(bm, i))
+#define smal_bitmap_clr_atomic(bm, i) __sync_fetch_and_and(&smal_bitmap_w(bm, i), ~ smal_bitmap_b(bm, i))
 
 /*********************************************************************
  * Global data.
@@ -233,18 +249,6 @@ static smal_thread_rwlock buffer_list_lock;
 static smal_buffer_list_head buffer_collecting;
 static smal_thread_rwlock buffer_collecting_lock;
 
-static size_t page_id_min, page_id_max;
-static int page_id_min_max_valid;
-
-static smal_buffer *buffer_table_init[] = { 0 };
-static smal_buffer **buffer_table = buffer_table_init;
-static size_t buffer_table_size = 1;
-static smal_buffer **buffer_table_mark = buffer_table_init;
-static size_t buffer_table_mark_size = 1;
-
-static smal_thread_rwlock buffer_table_lock;
-//static smal_thread_rwlock buffer_table_mark_lock;
-
 static smal_thread_lock _smal_collect_inner_lock;
 
 static size_t collect_id; /** may wrap. */
@@ -253,6 +257,16 @@ static int in_shutdown;
 static int in_mark;
 static int in_sweep;
 static int no_collect;
+#if SMAL_INCREMENTAL
+static int collect_phase; /** See incremental.h. */
+int _smal_collect_step(unsigned long budget_ns);
+#endif
+#if SMAL_GENERATIONAL
+static int collect_minor; /** See generational.h. */
+static void smal_buffer_before_minor_mark(smal_buffer *self);
+#else
+#define collect_minor 0
+#endif
 
 static
 void null_free_func(void *ptr)
@@ -267,20 +281,64 @@ void* null_mark_func(void *ptr)
   return 0;
 }
 
+/*********************************************************************
+ * Stats.
+ *
+ * smal_buffer stats are updated under the buffer's stats mutex.
+ * smal_type and global stats are sharded by thread and summed
+ * by smal_type_stats() and smal_global_stats().
+ */
+
+#ifndef smal_stats_SHARDS
+#if SMAL_PTHREAD
+#define smal_stats_SHARDS 16
+#else
+#define smal_stats_SHARDS 1
+#endif
+#endif
+
+#define smal_stats_COUNTERS (offsetof(smal_stats, _mutex) / sizeof(size_t))
+
+struct smal_stats_shard {
+  size_t n[smal_stats_COUNTERS];
+} __attribute__((aligned(64)));
+
+static struct smal_stats_shard global_stats_shards[smal_stats_SHARDS];
+
+#if smal_stats_SHARDS > 1
+#define smal_stats_shard_i() (smal_thread_self()->id % smal_stats_SHARDS)
+#define smal_stats_shard_add(P, X) ((void) __sync_fetch_and_add(P, X))
+#else
+#define smal_stats_shard_i() 0
+#define smal_stats_shard_add(P, X) ((void) (*(P) += (X)))
+#endif
+
 #define smal_LOCK_STATS(N)						\
-  do {									\
-    smal_thread_mutex_##N(&buffer_head.stats._mutex);			\
-    smal_thread_mutex_##N(&self->type->stats._mutex);			\
-    smal_thread_mutex_##N(&self->stats._mutex);				\
-  } while ( 0 ) 
+  smal_thread_mutex_##N(&self->stats._mutex)
 
 #define smal_UPDATE_STATS(N, EXPR)					\
   do {									\
-    buffer_head.stats.N EXPR;						\
-    self->type->stats.N EXPR;						\
-    self->stats.N EXPR;							\
+    size_t _smal_delta = 0;						\
+    _smal_delta EXPR;							\
+    self->stats.N += _smal_delta;					\
+    if ( SMAL_STATS_MASK & smal_stats_BIT(N) ) {			\
+      size_t _smal_i = smal_stats_shard_i();				\
+      smal_stats_shard_add(&global_stats_shards[_smal_i].n[offsetof(smal_stats, N) / sizeof(size_t)], _smal_delta); \
+      smal_stats_shard_add(&self->type->stats_shards[_smal_i].n[offsetof(smal_stats, N) / sizeof(size_t)], _smal_delta); \
+    }									\
   } while ( 0 )
 
+/* Sum shards into stats. */
+static
+void smal_stats_sum(smal_stats *stats, struct smal_stats_shard *shards)
+{
+  size_t *n = (size_t*) stats;
+  int s, i;
+  for ( s = 0; s < smal_stats_SHARDS; ++ s )
+    for ( i = 0; i < smal_stats_COUNTERS; ++ i )
+      n[i] += shards[s].n[i];
+}
+
 /*********************************************************************
  * mmap(), munmap()
  */
@@ -333,31 +391,68 @@ void* _smal_mark_ptr(void *, void*);
 static inline
 void _smal_mark_ptr_tail(void *, void*);
 
+static inline
+void *_smal_buffer_mark_ptr(smal_buffer *, void *, void *);
+
+static inline
+int smal_buffer_mark_test_set(smal_buffer *, void *);
+
+static inline
+void smal_buffer_mark_remember(smal_buffer *, void *, void *);
+
+smal_mark_TLS void * _smal_mark_referrer;
+
 #if SMAL_BUFFER_WRITE_BARRIER
 #include "buffer_write_barrier.h"
 #endif
 
-#if SMAL_MARK_QUEUE
-#include "mark_queue.h"
-// #define smal_after_mark_func() smal_mark_queue_mark(0)
-#define smal_after_mark_func() ((void) 0)
-#else
-#define smal_after_mark_func() ((void) 0)
-#endif
-
 #if SMAL_REMEMBERED_SET
 #include "remembered_set.h"
 #endif
 
+#if SMAL_ARENA
+#include "page_arena.h"
+#endif
+
 /************************************************************************
  ** Map any address to smal_buffer*.
  */
 
-#define smal_ptr_to_buffer(PTR,BUFFER_TABLE)			\
-  (BUFFER_TABLE[smal_addr_page_id(PTR) % BUFFER_TABLE##_size])
+/* Last page_id covered by a buffer; large object spans cover many pages. */
+#define smal_buffer_page_id_last(BUF)				\
+  smal_addr_page_id((BUF)->mmap_addr + (BUF)->mmap_size - 1)
+
+#include "epoch.h"
+#include "page_map.h"
+
+#if SMAL_SEGREGATE_BUFFER_FROM_PAGE
+#define smal_buffer_HEADER_SIZE sizeof(void*)
+#else
+#define smal_buffer_HEADER_SIZE sizeof(smal_buffer)
+#endif
 
+/* Largest object a single page smal_buffer can hold. */
+#define smal_buffer_object_size_MAX					\
+  ((smal_page_size - smal_buffer_HEADER_SIZE - sizeof(double)) & ~ (sizeof(double) - 1))
+
+/* mmap() size of a large object span: holds a single object. */
+#define smal_buffer_span_size(OBJECT_SIZE, OBJECT_ALIGNMENT)		\
+  (((OBJECT_SIZE) + smal_buffer_HEADER_SIZE + (OBJECT_ALIGNMENT) + smal_page_mask) & ~ smal_page_mask)
+
+/* Division-free (PTR - begin_ptr) / object_size; see smal_buffer_set_object_size_recip(). */
 #define smal_buffer_ptr_i(BUF, PTR)					\
-  (((void*)(PTR) - (BUF)->begin_ptr) / smal_buffer_object_size(BUF))
+  ((size_t) (((unsigned long long) ((void*)(PTR) - (BUF)->begin_ptr) * (BUF)->object_size_recip) >> (BUF)->object_size_shift))
+
+/* Inverse of smal_buffer_ptr_i(). */
+#define smal_buffer_i_ptr(BUF, I)					\
+  ((BUF)->begin_ptr + (I) * smal_buffer_object_size(BUF))
+
+/* For routines taking a constant SIZE: object_size if SIZE is 0. */
+#define smal_buffer_object_size_k(BUF, SIZE)				\
+  ((SIZE) ? (SIZE) : smal_buffer_object_size(BUF))
+
+#define smal_buffer_ptr_i_k(BUF, PTR, SIZE)				\
+  ((SIZE) ? (size_t) (((void*)(PTR) - (BUF)->begin_ptr) / (SIZE)) : smal_buffer_ptr_i(BUF, PTR))
 
 #if 0
 #define smal_buffer_alloc_ptr(BUF)					\
@@ -373,6 +468,29 @@ void _smal_mark_ptr_tail(void *, void*);
 #define smal_buffer_ptr_is_validQ(BUF, PTR)	\
   smal_buffer_ptr_is_in_rangeQ(BUF, PTR)
 
+#if SMAL_MARK_QUEUE
+#include "mark_queue.h"
+#if SMAL_PARALLEL_MARK
+#include "parallel_mark.h"
+#endif
+// #define smal_after_mark_func() smal_mark_queue_mark(0)
+#define smal_after_mark_func() ((void) 0)
+#else
+#define smal_after_mark_func() ((void) 0)
+#endif
+
+#if SMAL_CARD_MARKING
+#include "card_table.h"
+#endif
+
+#if SMAL_WRITE_BARRIER_SLICES
+#include "buffer_slices.h"
+#endif
+
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+#include "write_barrier_adapt.h"
+#endif
+
 void smal_buffer_print_all(smal_buffer *self, const char *action)
 {
   smal_buffer *buf;
@@ -391,105 +509,9 @@ void smal_buffer_print_all(smal_buffer *self, const char *action)
 static inline
 void smal_buffer_table_add(smal_buffer *self)
 {
-  size_t i;
-  size_t buffer_table_size_new;
-  smal_buffer **buffer_table_new;
-  
   // fprintf(stderr, "smal_buffer_table_add(%p)\n", self);
 
-  smal_thread_rwlock_wrlock(&buffer_table_lock);
-
-  /* Recompute page_id_min, page_id_max */
-  if ( page_id_min_max_valid ) {
-    /* page_id_min and page_id_max needs updating. */
-    if ( page_id_min > smal_buffer_page_id(self) )
-      page_id_min = smal_buffer_page_id(self);
-    else if ( page_id_max < smal_buffer_page_id(self) )
-      page_id_max = smal_buffer_page_id(self);
-  } else {
-    /* page_id_min and page_id_max is completely stale. */
-    smal_buffer *buf;
-    page_id_min = page_id_max = smal_buffer_page_id(self);
-    assert(page_id_min != 0);
-    assert(page_id_max != 0);
-
-    smal_thread_rwlock_rdlock(&buffer_list_lock);
-    smal_dllist_each(&buffer_list, buf); {
-      if ( page_id_min > smal_buffer_page_id(buf) )
-	page_id_min = smal_buffer_page_id(buf);
-      else if ( page_id_max < smal_buffer_page_id(buf) )
-	page_id_max = smal_buffer_page_id(buf);
-    } smal_dllist_each_end();
-    smal_thread_rwlock_unlock(&buffer_list_lock);
-
-    smal_thread_rwlock_rdlock(&buffer_collecting_lock);
-    smal_dllist_each(&buffer_collecting, buf); {
-      if ( page_id_min > smal_buffer_page_id(buf) )
-	page_id_min = smal_buffer_page_id(buf);
-      else if ( page_id_max < smal_buffer_page_id(buf) )
-	page_id_max = smal_buffer_page_id(buf);
-    } smal_dllist_each_end();
-    smal_thread_rwlock_unlock(&buffer_collecting_lock);
-
-    page_id_min_max_valid = 1;
-  }
-
-  buffer_table_size_new = (page_id_max - page_id_min) + 1;
-
-  {
-    size_t size = sizeof(buffer_table_new[0]) * (buffer_table_size_new + 1);
-    buffer_table_new = malloc(size);
-    malloc_overhead_size += size;
-    memset(buffer_table_new, 0, size);
-  }
-
-#if 0
-  fprintf(stderr, "smal_buffer_table_add(%p): malloc([%lu]) = %p\n", self, (unsigned long) buffer_table_size_new, buffer_table_new);
-  fprintf(stderr, "  %lu page_id %lu @ %p [%lu, %lu] %lu\n", (unsigned long) buffer_head.stats.buffer_n, (unsigned long) self->page_id, self, (unsigned long) page_id_min, (unsigned long) page_id_max, (unsigned long) buffer_table_size_new);
-#endif
-
-  for ( i = 0; i < buffer_table_size; ++ i ) {
-    smal_buffer *x = buffer_table[i];
-    if ( smal_likely(x) ) {
-      size_t j = smal_buffer_page_id(x) % buffer_table_size_new;
-      assert(! buffer_table_new[j]);
-      buffer_table_new[j] = x;
-    }
-  }
-
-  /* Allow buffer_table_mark to be independent of buffer_table during collection. */
-  if ( ! in_collect ) {
-    if ( buffer_table_mark != buffer_table ) {
-#if 0
-      fprintf(stderr, "smal_buffer_table_add(%p): free(buffer_table_mark = %p)\n", self, buffer_table_mark);
-#endif
-      free(buffer_table_mark);
-      malloc_overhead_size -= sizeof(buffer_table_mark[0]) * buffer_table_mark_size;
-    }
-#if 0
-    fprintf(stderr, "smal_buffer_table_add(%p): free(buffer_table = %p)\n", self, buffer_table);
-#endif
-    free(buffer_table);
-    malloc_overhead_size -= sizeof(buffer_table[0]) * buffer_table_size;
-    buffer_table_mark = buffer_table_new;
-    buffer_table_mark_size = buffer_table_size_new;
-  } else {
-    if ( buffer_table != buffer_table_mark ) {
-#if 0
-      fprintf(stderr, "smal_buffer_table_add(%p): free(buffer_table = %p)\n", self, buffer_table);
-#endif
-      free(buffer_table);
-      malloc_overhead_size -= sizeof(buffer_table[0]) * buffer_table_size;
-    }
-  }
-  buffer_table = buffer_table_new;
-  buffer_table_size = buffer_table_size_new;
-
-  i = smal_buffer_page_id(self) % buffer_table_size;
-  assert(! buffer_table[i]);
-  buffer_table[i] = self;
-
-  smal_thread_rwlock_unlock(&buffer_table_lock);
+  smal_page_map_add(self);
 
   smal_thread_rwlock_wrlock(&buffer_list_lock);
   smal_dllist_init(self);
@@ -497,27 +519,13 @@ void smal_buffer_table_add(smal_buffer *self)
   // smal_buffer_print_all(self, "add");
   smal_thread_rwlock_unlock(&buffer_list_lock);
   
-  smal_debug(all, 3, "buffer_table_size = %d", (int) buffer_table_size);
+  smal_debug(all, 3, "page_id [%lu, %lu]", (unsigned long) page_id_min, (unsigned long) page_id_max);
 }
 
 static inline
 void smal_buffer_table_remove(smal_buffer *self)
 {
-  size_t i;
-
-  smal_thread_rwlock_wrlock(&buffer_table_lock);
-
-  i = smal_buffer_page_id(self) % buffer_table_size;
-  assert(buffer_table[i] == self);
-  buffer_table[i] = 0;
-
-  /* Was buffer at beginning or end of buffer id space? */
-  if ( smal_unlikely(page_id_min == self->page_id) || 
-       smal_unlikely(page_id_max == self->page_id) ) {
-    page_id_min_max_valid = 0;
-  }
-
-  smal_thread_rwlock_unlock(&buffer_table_lock);
+  smal_page_map_remove(self);
 
   // smal_thread_rwlock_wrlock(&buffer_list_lock);
   smal_dllist_delete(self); /* Remove from global buffer list. */
@@ -532,11 +540,44 @@ int smal_buffer_set_object_size(smal_buffer *self, size_t object_size);
 void smal_buffer_write_unprotect(smal_buffer *);
 #endif
 
+/* mmap() memory for buffers, using huge pages if smal_page_size is large enough. */
+static
+void *smal_buffer_mmap(size_t size)
+{
+  void *addr;
+#ifdef MAP_HUGETLB
+  if ( smal_page_hugetlb && ! (smal_page_size % smal_huge_page_size) ) {
+    addr = smal_mmap((void*) 0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, (off_t) 0);
+    if ( addr != MAP_FAILED )
+      return addr;
+    /* No reserved huge pages: do not try again. */
+    smal_page_hugetlb = 0;
+  }
+#endif
+  addr = smal_mmap((void*) 0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+#ifdef MADV_HUGEPAGE
+  if ( addr != MAP_FAILED && smal_page_size >= smal_huge_page_size )
+    madvise(addr, size, MADV_HUGEPAGE);
+#endif
+  return addr;
+}
+
+/* Return buffer memory to its arena or to the OS. */
+static
+int smal_buffer_munmap(void *addr, size_t size)
+{
+#if SMAL_ARENA
+  if ( smal_arena_free(addr, size) )
+    return 0;
+#endif
+  return smal_munmap(addr, size);
+}
+
 static // inline
 smal_buffer *smal_buffer_alloc(smal_type *type)
 {
   smal_buffer *self;
-  size_t mmap_size;
+  size_t buffer_size, mmap_size;
   void *mmap_addr;
   size_t offset;
   int result;
@@ -544,9 +585,19 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
   
   smal_debug(buffer, 1, "()");
 
+  /* Large objects get a span of pages to themselves. */
+  buffer_size = smal_page_size;
+  if ( smal_unlikely(type->desc.object_size > smal_buffer_object_size_MAX) )
+    buffer_size = smal_buffer_span_size(type->desc.object_size, type->desc.object_alignment);
+
+  mmap_size = buffer_size;
+#if SMAL_ARENA
+  if ( smal_likely((mmap_addr = smal_arena_alloc(buffer_size))) )
+    goto aligned;
+#endif
+
   /* Attempt first alignment via exact size. */
-  mmap_size = smal_page_size;
-  mmap_addr = smal_mmap((void*) 0, mmap_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+  mmap_addr = smal_buffer_mmap(mmap_size);
   if ( mmap_addr == MAP_FAILED ) {
     smal_debug(mmap, 3, "mmap failed: %s", strerror(errno));
     return 0;
@@ -559,10 +610,9 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
 
     result = smal_munmap(mmap_addr, mmap_size);
 
-    /* mmap() enough to ensure a buffer of smal_page_size, aligned to smal_page_size */
-    /* Allocate twice the size needed. */
-    mmap_size = smal_page_size * 2;
-    mmap_addr = smal_mmap((void*) 0, mmap_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, (off_t) 0);
+    /* mmap() enough to ensure a buffer of buffer_size, aligned to smal_page_size */
+    mmap_size = buffer_size + smal_page_size;
+    mmap_addr = smal_buffer_mmap(mmap_size);
     if ( mmap_addr == MAP_FAILED ) {
       smal_debug(mmap, 3, "mmap failed: %s", strerror(errno));
       return 0;
@@ -573,13 +623,13 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
       free_addr_1 = mmap_addr;
       keep_addr = mmap_addr + (smal_page_size - offset);
       free_size_1 = keep_addr - free_addr_1;
-      keep_size = smal_page_size;
-      free_addr_2 = keep_addr + smal_page_size;
+      keep_size = buffer_size;
+      free_addr_2 = keep_addr + buffer_size;
       free_size_2 = (mmap_addr + mmap_size) - free_addr_2; 
     } else {
       keep_addr = mmap_addr;
-      keep_size = smal_page_size;
-      free_addr_1 = mmap_addr + smal_page_size;
+      keep_size = buffer_size;
+      free_addr_1 = mmap_addr + buffer_size;
       free_size_1 = mmap_size - keep_size;
     }
     
@@ -610,6 +660,9 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
     mmap_addr = keep_addr;
     mmap_size = keep_size;
   }
+#if SMAL_ARENA
+ aligned:
+#endif
 
 #if SMAL_SEGREGATE_BUFFER_FROM_PAGE
   if ( ! (self = malloc(sizeof(*self))) )
@@ -636,8 +689,6 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
   smal_thread_mutex_init(&self->stats._mutex);
   smal_thread_mutex_init(&self->alloc_ptr_mutex);
   // smal_thread_rwlock_init(&self->mark_bits_lock);
-  smal_thread_rwlock_init(&self->free_bits_lock);
-  smal_thread_mutex_init(&self->free_list_mutex);
 
   smal_thread_lock_init(&self->alloc_disabled);
 
@@ -656,7 +707,7 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
 
     smal_LOCK_STATS(lock);
     smal_UPDATE_STATS(buffer_id,  += 1); /* for global and type */
-    self->buffer_id = self->stats.buffer_id = buffer_head.stats.buffer_id;
+    self->buffer_id = self->stats.buffer_id = __sync_add_and_fetch(&buffer_head.buffer_id, 1);
     smal_UPDATE_STATS(buffer_n,   += 1);
     smal_UPDATE_STATS(mmap_size,  += self->mmap_size);
     smal_UPDATE_STATS(mmap_total, += self->mmap_size);
@@ -669,7 +720,7 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
  done:
   if ( smal_unlikely(! ok) ) {
     smal_debug(buffer, 2, " smal_buffer_set_object_size failed: %s", strerror(errno));
-    result = smal_munmap(mmap_addr, mmap_size);
+    result = smal_buffer_munmap(mmap_addr, mmap_size);
     assert(result == 0);
 #if SMAL_SEGREGATE_BUFFER_FROM_PAGE
     free(self);
@@ -687,6 +738,39 @@ smal_buffer *smal_buffer_alloc(smal_type *type)
   return self;
 }
 
+/*
+  Precompute smal_buffer_ptr_i() as (offset * recip) >> shift.
+  A power-of-2 object_size is a plain shift.
+  Otherwise, for offsets < 2^N and object_size <= 2^L, recip = ceil(2^(N+L) / object_size) is exact:
+  its error is less than object_size / 2^L <= 1 for each quotient.
+  A buffer with a single object always has index 0.
+*/
+static inline
+void smal_buffer_set_object_size_recip(smal_buffer *self)
+{
+  size_t d = self->object_size;
+  int n_bits, l_bits;
+
+  if ( self->object_capacity <= 1 ) {
+    self->object_size_recip = 0;
+    self->object_size_shift = 0;
+    return;
+  }
+  if ( ! (d & (d - 1)) ) {
+    self->object_size_recip = 1;
+    self->object_size_shift = __builtin_ctzl(d);
+    return;
+  }
+  for ( n_bits = 0; ((size_t) 1 << n_bits) < self->mmap_size; ++ n_bits )
+    ;
+  for ( l_bits = 0; ((size_t) 1 << l_bits) < d; ++ l_bits )
+    ;
+  /* offset * recip < 2^(2N+1) must not overflow. */
+  assert(n_bits * 2 + 1 < sizeof(self->object_size_recip) * 8);
+  self->object_size_shift = n_bits + l_bits;
+  self->object_size_recip = ((1ULL << self->object_size_shift) + d - 1) / d;
+}
+
 static inline
 int smal_buffer_set_object_size(smal_buffer *self, size_t object_size)
 {
@@ -717,6 +801,7 @@ int smal_buffer_set_object_size(smal_buffer *self, size_t object_size)
   self->object_capacity = (self->end_ptr - self->begin_ptr) / self->object_size;
   self->end_ptr = self->begin_ptr + (self->object_capacity * self->object_size);
   assert(self->end_ptr <= self->mmap_addr + self->mmap_size);
+  smal_buffer_set_object_size_recip(self);
 
   /* Free bits cover entire mmap area: see smal_buffer_ptr_i(). */
   self->free_bits.size = 
@@ -738,9 +823,23 @@ int smal_buffer_set_object_size(smal_buffer *self, size_t object_size)
   }
 
 #if SMAL_BUFFER_WRITE_BARRIER
-  if ( self->type->desc.mostly_unchanging )
+  /* The write barrier finds buffers by their first page; not supported for large object spans. */
+  if ( self->type->desc.mostly_unchanging && self->mmap_size == smal_page_size )
     self->mutation_write_barrier = 
       self->use_remembered_set = 1;
+#if SMAL_GENERATIONAL
+  /* Minor collections only scan buffers written since the last collection. */
+  if ( smal_generational && self->mmap_size == smal_page_size )
+    self->mutation_write_barrier = 1;
+#endif
+#endif
+#if SMAL_CARD_MARKING
+  if ( self->type->desc.card_marking )
+    smal_buffer_cards_init(self);
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( self->mutation_write_barrier || self->use_remembered_set )
+    smal_buffer_slices_init(self);
 #endif
 
   smal_LOCK_STATS(lock);
@@ -787,13 +886,10 @@ void smal_buffer_stop_allocations(smal_buffer *self)
   smal_thread_mutex_unlock(&self->type->alloc_buffer_mutex);
 }
 
+/* Make a buffer unreachable: no longer allocated from, marked, swept or counted as active. */
 static inline
-void smal_buffer_free(smal_buffer *self)
+void smal_buffer_detach(smal_buffer *self)
 {
-  int result;
-  void *mmap_addr = self->mmap_addr; 
-  size_t mmap_size = self->mmap_size;
-
   smal_debug(buffer, 1, "(@%p)", self);
 
   assert(in_collect || in_shutdown);
@@ -804,7 +900,7 @@ void smal_buffer_free(smal_buffer *self)
 #endif
 
 #if SMAL_REMEMBERED_SET
-  smal_remembered_set_free(self->remembered_set);
+  smal_remembered_set_free(self->remembered_set, smal_buffer_remembered_set_n(self));
 #endif
 
   // Remove self from buffer table.
@@ -824,11 +920,6 @@ void smal_buffer_free(smal_buffer *self)
   self->type_buffer_list.buffer = 0;
   smal_thread_rwlock_unlock(&self->type->buffers_lock);
 
-  // Free bitmaps.
-  smal_bitmap_free(&self->free_bits);
-  smal_bitmap_free(&self->mark_bits);
-  smal_bitmap_free(&self->grey_bits);
-
   smal_LOCK_STATS(lock);
   smal_UPDATE_STATS(capacity_n, -= self->stats.capacity_n);
   smal_UPDATE_STATS(alloc_n,    -= self->stats.alloc_n);
@@ -838,12 +929,32 @@ void smal_buffer_free(smal_buffer *self)
   smal_UPDATE_STATS(buffer_n,   -= 1);
   smal_UPDATE_STATS(mmap_size,  -= self->mmap_size);
   smal_LOCK_STATS(unlock);
+}
+
+/* Free the resources of a detached buffer. */
+static inline
+void smal_buffer_release(smal_buffer *self)
+{
+  int result;
+  void *mmap_addr = self->mmap_addr; 
+  size_t mmap_size = self->mmap_size;
+
+  smal_debug(buffer, 1, "(@%p)", self);
+
+  // Free bitmaps.
+  smal_bitmap_free(&self->free_bits);
+  smal_bitmap_free(&self->mark_bits);
+  smal_bitmap_free(&self->grey_bits);
+#if SMAL_CARD_MARKING
+  smal_buffer_cards_free(self);
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  smal_buffer_slices_free(self);
+#endif
 
   smal_thread_mutex_destroy(&self->stats._mutex);
   smal_thread_mutex_destroy(&self->alloc_ptr_mutex);
   // smal_thread_rwlock_destroy(&self->mark_bits_lock);
-  smal_thread_rwlock_destroy(&self->free_bits_lock);
-  smal_thread_mutex_destroy(&self->free_list_mutex);
 
   smal_thread_lock_destroy(&self->alloc_disabled);
 
@@ -859,13 +970,26 @@ void smal_buffer_free(smal_buffer *self)
   malloc_overhead_size -= sizeof(*self);
 #endif
 
-  result = smal_munmap(mmap_addr, mmap_size);
+  result = smal_buffer_munmap(mmap_addr, mmap_size);
   assert(result == 0);
 }
 
+static inline
+void smal_buffer_free(smal_buffer *self)
+{
+  smal_buffer_detach(self);
+  smal_buffer_release(self);
+}
+
+#if SMAL_BUFFER_POOL
+#include "buffer_pool.h"
+#endif
+
 smal_buffer *smal_buffer_from_ptr(void *ptr)
 {
-  smal_buffer *buf = smal_ptr_to_buffer(ptr, buffer_table);
+  smal_thread *thr = smal_epoch_enter();
+  smal_buffer *buf = smal_ptr_to_buffer(ptr);
+  smal_epoch_exit(thr);
   return buf && smal_buffer_ptr_is_validQ(buf, ptr) ? buf : 0;
 }
 
@@ -879,10 +1003,95 @@ smal_buffer *smal_buffer_from_ptr(void *ptr)
 #define smal_buffer_mark(BUF, PTR)				\
   smal_bitmap_set_c(&(BUF)->mark_bits, smal_buffer_ptr_i(BUF, PTR))
 
+/* Sets the mark bit; returns true if it was already set.  Atomic while marking in parallel or incrementally. */
+static inline
+int smal_buffer_mark_test_set(smal_buffer *self, void *ptr)
+{
+  size_t i = smal_buffer_ptr_i(self, ptr);
+#if SMAL_PARALLEL_MARK
+  if ( mark_parallel )
+    return (smal_bitmap_set_atomic(&self->mark_bits, i) & smal_bitmap_b(&self->mark_bits, i)) != 0;
+#endif
+#if SMAL_INCREMENTAL
+  /* smal_write_barrier() may mark from other threads. */
+  if ( _smal_collect_marking )
+    return (smal_bitmap_set_atomic(&self->mark_bits, i) & smal_bitmap_b(&self->mark_bits, i)) != 0;
+#endif
+  if ( smal_bitmap_setQ(&self->mark_bits, i) )
+    return 1;
+  smal_bitmap_set_c(&self->mark_bits, i);
+  return 0;
+}
+
 #define smal_buffer_freeQ(BUF, PTR)				\
   smal_bitmap_setQ(&(BUF)->free_bits, smal_buffer_ptr_i(BUF, PTR))
 
-void * _smal_mark_referrer;
+#define smal_buffer_free_set(BUF, PTR)				\
+  smal_bitmap_set_atomic(&(BUF)->free_bits, smal_buffer_ptr_i(BUF, PTR))
+
+#define smal_buffer_free_clr(BUF, PTR)				\
+  smal_bitmap_clr_atomic(&(BUF)->free_bits, smal_buffer_ptr_i(BUF, PTR))
+
+/************************************************************************************
+ * Lock-free free list.
+ * A Treiber stack; the head carries a tag incremented on every update to avoid ABA.
+ */
+
+#define smal_free_list_ptr(BUF, HEAD)					\
+  ((HEAD) & 0xffffffffULL ? (BUF)->mmap_addr + (size_t) ((HEAD) & 0xffffffffULL) : (void*) 0)
+
+#define smal_free_list_head(BUF, PTR, TAG)				\
+  ((((smal_free_list_head) (TAG)) << 32) | ((PTR) ? (smal_free_list_head) ((void*) (PTR) - (BUF)->mmap_addr) : 0))
+
+#define smal_free_list_tag(HEAD) ((HEAD) >> 32)
+
+#define smal_free_list_emptyQ(BUF) (! ((BUF)->free_list & 0xffffffffULL))
+
+static inline
+void *smal_free_list_pop(smal_buffer *self)
+{
+  smal_free_list_head old, new;
+  void *ptr;
+  do {
+    old = self->free_list;
+    if ( ! (ptr = smal_free_list_ptr(self, old)) )
+      return 0;
+    /* ptr may be popped and overwritten by another thread; the tag check below catches that. */
+    new = smal_free_list_head(self, * (void* volatile *) ptr, smal_free_list_tag(old) + 1);
+  } while ( ! __sync_bool_compare_and_swap(&self->free_list, old, new) );
+  return ptr;
+}
+
+/* Push a chain of objects linked from first to last. */
+static inline
+void smal_free_list_push_n(smal_buffer *self, void *first, void *last)
+{
+  smal_free_list_head old, new;
+  do {
+    old = self->free_list;
+    * (void**) last = smal_free_list_ptr(self, old);
+    new = smal_free_list_head(self, first, smal_free_list_tag(old) + 1);
+  } while ( ! __sync_bool_compare_and_swap(&self->free_list, old, new) );
+}
+
+#define smal_free_list_push(BUF, PTR) smal_free_list_push_n(BUF, PTR, PTR)
+
+static inline
+void smal_buffer_mark_remember(smal_buffer *self, void *referrer, void *ptr)
+{
+#if SMAL_REMEMBERED_SET
+  smal_buffer *referrer_buf;
+  /* Record pointers from the referrer buffer to the ptr buffer? */
+  if ( referrer && 
+       (referrer_buf = smal_ptr_to_buffer(referrer)) &&
+       referrer_buf->record_remembered_set &&
+       referrer_buf != self ) {
+    smal_remembered_set *rs = referrer_buf->remembered_set + smal_buffer_remembered_set_i(referrer_buf, referrer);
+    if ( rs->record )
+      smal_remembered_set_add(rs, referrer, ptr);
+  }
+#endif
+}
 
 static inline
 void * _smal_buffer_mark_ptr(smal_buffer *self, void *referrer, void *ptr)
@@ -896,25 +1105,13 @@ void * _smal_buffer_mark_ptr(smal_buffer *self, void *referrer, void *ptr)
 	     (unsigned int) smal_buffer_mark_word(self, ptr));
 #endif
 
-#if SMAL_REMEMBERED_SET
-  {
-    smal_buffer *referrer_buf;
-    /* Record pointers from the referrer buffer to the ptr buffer? */
-    if ( referrer && 
-	 (referrer_buf = smal_ptr_to_buffer(referrer, buffer_table_mark))->record_remembered_set &&
-	 referrer_buf != self ) {
-      smal_remembered_set_add(referrer_buf->remembered_set, referrer, ptr);
-    }
-  }
-#endif
+  smal_buffer_mark_remember(self, referrer, ptr);
 
-  if ( ! smal_buffer_markQ(self, ptr) ) {
+  if ( ! smal_buffer_mark_test_set(self, ptr) ) {
 #if 0
     smal_debug(mark, 5, "ptr @%p is unmarked", ptr);
 #endif
 
-    smal_buffer_mark(self, ptr);
-
     if ( smal_unlikely(! self->markable) )
       return 0;
 #ifndef smal_MARK_FUNC
@@ -932,7 +1129,7 @@ static inline
 void * _smal_mark_ptr(void *referrer, void *ptr)
 {
   smal_buffer *buf;
-  if ( (buf = smal_ptr_to_buffer(ptr, buffer_table_mark)) ) {
+  if ( (buf = smal_ptr_to_buffer(ptr)) ) {
     // smal_debug(mark, 5, "ptr @%p => buf @%p", ptr, buf);
     if ( smal_buffer_ptr_is_validQ(buf, ptr) ) {
       // Realign interior ptrs.
@@ -942,7 +1139,7 @@ void * _smal_mark_ptr(void *referrer, void *ptr)
 	fprintf(stderr, "  Align @%p - %d to @%p", ptr, offset, ptr - offset);
       }
 #endif
-      ptr = buf->begin_ptr + ((ptr - buf->begin_ptr) / buf->object_size) * buf->object_size;
+      ptr = smal_buffer_i_ptr(buf, smal_buffer_ptr_i(buf, ptr));
       return _smal_buffer_mark_ptr(buf, referrer, ptr);
     }
   }
@@ -990,6 +1187,7 @@ void smal_mark_ptr_n(void *referrer, int n_ptrs, void **ptrs)
 {
   while ( -- n_ptrs >= 0 ) {
     _smal_mark_ptr_tail(referrer, *(ptrs ++));
+  }
 }
 void smal_mark_bindings(int n, void ***bindings)
 {
@@ -1000,15 +1198,68 @@ void smal_mark_bindings(int n, void ***bindings)
 }
 #endif
 
+#if SMAL_MARK_RANGE_ALIGNED
+#define smal_mark_range_STEP sizeof(void*)
+#else
+#define smal_mark_range_STEP sizeof(int)
+#endif
+
+/* Only words within the pages of page_id_min .. page_id_max can be object pointers. */
+#define smal_mark_range_candidateQ(P, LO, SIZE) ((size_t) (P) - (LO) < (SIZE))
+
+/* Skip words in pages without a buffer before queuing them. */
+#define smal_mark_range_word(REFERRER, P, LO, SIZE)			\
+  if ( smal_unlikely(smal_mark_range_candidateQ(P, LO, SIZE)) &&	\
+       smal_ptr_to_buffer(P) )						\
+    smal_mark_ptr(REFERRER, (void*) (P))
+
+#if SMAL_MARK_RANGE_SIMD
+#define smal_mark_range_LANES 4
+/* Loads from any smal_mark_range_STEP alignment. */
+typedef size_t smal_mark_range_vec __attribute__((vector_size(sizeof(size_t) * smal_mark_range_LANES), aligned(sizeof(int))));
+
+/* Test LANES words at stride sizeof(void*) at once; most words are rejected without a branch each. */
+static inline
+void _smal_mark_ptr_range_vec(void *referrer, void *ptr, size_t lo, size_t size)
+{
+  smal_mark_range_vec v = * (smal_mark_range_vec*) ptr;
+  smal_mark_range_vec m = (smal_mark_range_vec) ((v - lo) < size);
+  if ( smal_unlikely(m[0] | m[1] | m[2] | m[3]) ) {
+    int i;
+    for ( i = 0; i < smal_mark_range_LANES; ++ i ) {
+      if ( m[i] && smal_ptr_to_buffer(v[i]) )
+	smal_mark_ptr(referrer, (void*) v[i]);
+    }
+  }
+}
+#endif
+
 static inline
 void _smal_mark_ptr_range(void *referrer, void *ptr, void *ptr_end)
 {
+  size_t lo, size;
+
   // fprintf(stderr, "   smpr [@%p, @%p] ALIGNED\n", ptr, ptr_end);
+  if ( smal_unlikely(! page_id_max) )
+    return;
+  lo = page_id_min << smal_page_shift;
+  size = (page_id_max - page_id_min + 1) << smal_page_shift;
+
+#if SMAL_MARK_RANGE_SIMD
+  /* Each block covers every smal_mark_range_STEP position in sizeof(smal_mark_range_vec) bytes. */
+  while ( ptr + sizeof(smal_mark_range_vec) - smal_mark_range_STEP < ptr_end ) {
+    size_t offset;
+    for ( offset = 0; offset < sizeof(void*); offset += smal_mark_range_STEP )
+      _smal_mark_ptr_range_vec(referrer, ptr + offset, lo, size);
+    ptr += sizeof(smal_mark_range_vec);
+  }
+#endif
+
   while ( ptr < ptr_end ) {
-    void *p = *(void**) ptr;
+    size_t p = *(size_t*) ptr;
     // fprintf(stderr, "     smpr *@%p = @%p\n", ptr, p);
-    smal_mark_ptr(referrer, p);
-    ptr += sizeof(int);
+    smal_mark_range_word(referrer, p, lo, size);
+    ptr += smal_mark_range_STEP;
   }
 }
 
@@ -1030,13 +1281,14 @@ int smal_object_reachableQ(void *ptr)
 {
   smal_buffer *buf;
   // assert(in_collect);
-  buf = smal_ptr_to_buffer(ptr, buffer_table_mark);
-  if ( smal_likely(smal_buffer_ptr_is_in_rangeQ(buf, ptr)) )
+  buf = smal_ptr_to_buffer(ptr);
+  if ( smal_likely(buf && smal_buffer_ptr_is_in_rangeQ(buf, ptr)) )
     return ! ! smal_buffer_markQ(buf, ptr);
   else
     return 0;
 }
 
+#if ! SMAL_ALLOC_CACHE
 static // inline
 void *smal_buffer_alloc_object(smal_buffer *self)
 {
@@ -1047,21 +1299,11 @@ void *smal_buffer_alloc_object(smal_buffer *self)
   if ( smal_unlikely(smal_thread_lock_test(&self->alloc_disabled)) )
     return 0;
 
-  smal_thread_mutex_lock(&self->free_list_mutex);
-  if ( smal_likely((ptr = self->free_list)) ) {
+  if ( smal_likely((ptr = smal_free_list_pop(self))) ) {
     // fprintf(stderr, "  t@%p b@%p free_n %lu => @%p\n", smal_thread_self(), self, (unsigned long) self->stats.free_n, ptr);
     free_n = 1;
-
-    self->free_list = * (void**) ptr;
-    smal_thread_rwlock_wrlock(&self->free_bits_lock);
-    smal_bitmap_clr_c(&self->free_bits, smal_buffer_ptr_i(self, ptr));
-    smal_thread_rwlock_unlock(&self->free_bits_lock);
-
-    smal_thread_mutex_unlock(&self->free_list_mutex);
-
+    smal_buffer_free_clr(self, ptr);
   } else {
-    smal_thread_mutex_unlock(&self->free_list_mutex);
-
     smal_thread_mutex_lock(&self->alloc_ptr_mutex);
     if ( smal_likely(self->alloc_ptr < self->end_ptr) ) {
       alloc_n = 1;
@@ -1077,7 +1319,11 @@ void *smal_buffer_alloc_object(smal_buffer *self)
 #if SMAL_BUFFER_WRITE_BARRIER
   /* Assume buffer is mutated because we are allocating from it. */
   if ( smal_likely(ptr) )
-    smal_buffer_assume_mutation(self); 
+    smal_buffer_assume_mutation(self, ptr, smal_buffer_object_size(self)); 
+#endif
+#if SMAL_GENERATIONAL
+  if ( smal_likely(ptr) )
+    self->young = 1;
 #endif
 
   smal_LOCK_STATS(lock);
@@ -1088,8 +1334,6 @@ void *smal_buffer_alloc_object(smal_buffer *self)
     smal_UPDATE_STATS(alloc_n, += alloc_n);
 #if 0
     assert(self->stats.avail_n > 0);
-    assert(self->type->stats.avail_n > 0);
-    assert(buffer_head.stats.avail_n > 0);
 #endif
     smal_UPDATE_STATS(avail_n, -= 1);
 
@@ -1106,49 +1350,206 @@ void *smal_buffer_alloc_object(smal_buffer *self)
   }
   smal_LOCK_STATS(unlock);
 
-  smal_debug(object_alloc, 2, "(b@%p) = @%p #%lu", self, ptr, (unsigned long) buffer_head.stats.alloc_id);
+  smal_debug(object_alloc, 2, "(b@%p) = @%p #%lu", self, ptr, (unsigned long) self->stats.alloc_id);
   smal_debug(object_alloc, 3, "  alloc_ptr = @%p, stats.alloc_n = %d", self->alloc_ptr, self->stats.alloc_n);
   smal_debug(object_alloc, 3, "  stats.free_n = %d, stats.avail_n = %d, stats.live_n = %d",
 	     self->stats.free_n, self->stats.avail_n, self->stats.live_n);
 
   return ptr;
 }
+#endif
+
+/*
+  Detach up to max_n objects from this buffer in one locking step:
+  either a segment of free_list (returned in *free_listp, 0-terminated),
+  or a run of contiguous objects from alloc_ptr (returned in *run_ptrp).
+  The objects are accounted as allocated, except alloc_id and live_n,
+  which are left to the caller.
+  Returns the number of objects detached.
+  object_size is a constant for size-specialized kernels or 0, see size_kernel.h.
+*/
+static smal_always_inline
+size_t _smal_buffer_alloc_objects(smal_buffer *self, size_t max_n, void **free_listp, void **run_ptrp, size_t object_size)
+{
+  void *ptr;
+  size_t free_n = 0;
+  size_t alloc_n = 0;
 
+  *free_listp = *run_ptrp = 0;
+
+  if ( smal_unlikely(smal_thread_lock_test(&self->alloc_disabled)) )
+    return 0;
+
+  if ( smal_likely(! smal_free_list_emptyQ(self)) ) {
+    void **nextp = free_listp;
+    while ( free_n < max_n && (ptr = smal_free_list_pop(self)) ) {
+      size_t i = smal_buffer_ptr_i_k(self, ptr, object_size);
+      smal_bitmap_clr_atomic(&self->free_bits, i);
+      if ( in_collect )
+	smal_bitmap_set_c(&self->mark_bits, i);
+      ++ free_n;
+      *nextp = ptr;
+      nextp = (void**) ptr;
+    }
+    *nextp = 0;
+  }
+  if ( ! free_n ) {
+    smal_thread_mutex_lock(&self->alloc_ptr_mutex);
+    alloc_n = (self->end_ptr - self->alloc_ptr) / smal_buffer_object_size_k(self, object_size);
+    if ( alloc_n > max_n )
+      alloc_n = max_n;
+    if ( smal_likely(alloc_n) ) {
+      *run_ptrp = ptr = self->alloc_ptr;
+      self->alloc_ptr += alloc_n * smal_buffer_object_size_k(self, object_size);
+      assert(self->alloc_ptr <= self->end_ptr);
+    }
+    smal_thread_mutex_unlock(&self->alloc_ptr_mutex);
+
+    if ( in_collect && alloc_n ) {
+      size_t i = smal_buffer_ptr_i_k(self, ptr, object_size);
+      size_t i_end = i + alloc_n;
+      for ( ; i < i_end; ++ i )
+	smal_bitmap_set_c(&self->mark_bits, i);
+    }
+  }
+
+  if ( smal_likely(free_n + alloc_n) ) {
+#if SMAL_BUFFER_WRITE_BARRIER
+    /* Linking *free_listp wrote to each of its objects. */
+    if ( alloc_n )
+      smal_buffer_assume_mutation(self, *run_ptrp, alloc_n * smal_buffer_object_size_k(self, object_size));
+    else
+      smal_buffer_assume_mutation(self, *free_listp, smal_buffer_object_size_k(self, object_size));
+#endif
+#if SMAL_GENERATIONAL
+    self->young = 1;
+#endif
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(free_n, -= free_n);
+    smal_UPDATE_STATS(alloc_n, += alloc_n);
+    smal_UPDATE_STATS(avail_n, -= free_n + alloc_n);
+    smal_LOCK_STATS(unlock);
+  }
+
+  smal_debug(object_alloc, 2, "(b@%p, %lu) = %lu from free_list, %lu from alloc_ptr", self,
+	     (unsigned long) max_n, (unsigned long) free_n, (unsigned long) alloc_n);
+
+  return free_n + alloc_n;
+}
 
 static
-void smal_buffer_free_object(smal_buffer *self, void *ptr)
+size_t smal_buffer_alloc_objects(smal_buffer *self, size_t max_n, void **free_listp, void **run_ptrp);
+
+/* Account for objects detached by smal_buffer_alloc_objects() being handed out. */
+static
+void smal_buffer_alloc_objects_publish(smal_buffer *self, size_t alloc_n)
 {
-  // assume free_bits and free_list mutexs are locked.
-  // smal_thread_mutex_lock(&self->free_bits_mutex);
-  assert(! smal_bitmap_setQ(&self->free_bits, smal_buffer_ptr_i(self, ptr)));
-  smal_bitmap_set_c(&self->free_bits, smal_buffer_ptr_i(self, ptr));
-  // smal_thread_mutex_unlock(&self->free_bits_mutex);
+  smal_LOCK_STATS(lock);
+  smal_UPDATE_STATS(alloc_id, += alloc_n);
+  smal_UPDATE_STATS(live_n, += alloc_n);
+  smal_LOCK_STATS(unlock);
+}
+
+static
+smal_buffer *smal_type_alloc_buffer(smal_type *self);
+
+#if SMAL_ALLOC_CACHE
+#include "alloc_cache.h"
 
-  // Should we unlock free_bits and free_list?
-  self->type->desc.free_func(ptr);
+#else
+
+#define smal_alloc_cache_flush_all() ((void) 0)
+#define smal_alloc_cache_publish_all() ((void) 0)
+#define smal_alloc_cache_free_all() ((void) 0)
+
+#endif
 
-  // smal_thread_mutex_lock(&self->free_list_mutex);
-  * ((void**) ptr) = self->free_list;
-  self->free_list = ptr;
-  // smal_thread_mutex_unlock(&self->free_list_mutex);
+
+static
+void _smal_buffer_free_object(smal_buffer *self, void *ptr, smal_free_func free_func)
+{
+  unsigned int old_bits;
+
+#if SMAL_GENERATIONAL
+  /* Mark bits are sticky: ptr must be young when it is allocated again. */
+  if ( smal_unlikely(smal_buffer_markQ(self, ptr)) )
+    smal_bitmap_clr_atomic(&self->mark_bits, smal_buffer_ptr_i(self, ptr));
+#endif
+
+  /* Set free bit first: ptr cannot be allocated until it is pushed. */
+  old_bits = smal_buffer_free_set(self, ptr);
+  assert(! (old_bits & smal_bitmap_b(&self->free_bits, smal_buffer_ptr_i(self, ptr))));
+  (void) old_bits;
+
+  if ( free_func )
+    free_func(ptr);
+
+  smal_free_list_push(self, ptr);
 
   smal_LOCK_STATS(lock);
   smal_UPDATE_STATS(free_n, += 1);
-  assert(buffer_head.stats.free_n);
   smal_UPDATE_STATS(free_id, += 1);
-#if 0
-  if ( buffer_head.stats.free_id == 101 )
-    abort();
-#endif
   smal_UPDATE_STATS(avail_n, += 1);
   smal_LOCK_STATS(unlock);
 
-  smal_debug(object_free, 2, "b@%p: (@%p) #%lu", self, ptr, (unsigned long) buffer_head.stats.free_id);
+  smal_debug(object_free, 2, "b@%p: (@%p) #%lu", self, ptr, (unsigned long) self->stats.free_id);
   smal_debug(object_free, 3, "  alloc_ptr = @%p, stats.alloc_n = %d", self->alloc_ptr, self->stats.alloc_n);
   smal_debug(object_free, 3, "  stats.free_n = %d, stats.avail_n = %d, stats.live_n = %d",
 	     self->stats.free_n, self->stats.avail_n, self->stats.live_n);
 }
 
+#define smal_buffer_free_object(BUF, PTR)				\
+  _smal_buffer_free_object(BUF, PTR, (BUF)->type->desc.free_func)
+
+/*
+  Free unmarked, allocated objects before alloc_ptr; returns the number of marked objects.
+  object_size is a constant for size-specialized kernels or 0, see size_kernel.h.
+*/
+static smal_always_inline
+size_t _smal_buffer_sweep_objects(smal_buffer *self, void *alloc_ptr, size_t object_size)
+{
+  size_t live_n = 0;
+  void *ptr;
+  size_t i;
+  /* Index bitmaps directly, rather than by smal_buffer_ptr_i(). */
+  for ( i = 0, ptr = self->begin_ptr; ptr < alloc_ptr; ++ i, ptr += smal_buffer_object_size_k(self, object_size) ) {
+    if ( smal_bitmap_setQ(&self->mark_bits, i) ) {
+      ++ live_n;
+      // fprintf(stderr, "+");
+    } else {
+      if ( smal_likely(! smal_bitmap_setQ(&self->free_bits, i)) ) {
+	// fprintf(stderr, "-");
+	smal_buffer_free_object(self, ptr);
+      }
+    }
+  }
+  return live_n;
+}
+
+#if SMAL_SIZE_KERNELS
+#include "size_kernel.h"
+#endif
+
+static
+size_t smal_buffer_alloc_objects(smal_buffer *self, size_t max_n, void **free_listp, void **run_ptrp)
+{
+#if SMAL_SIZE_KERNELS
+  if ( smal_likely(self->type->kernel) )
+    return self->type->kernel->alloc_objects(self, max_n, free_listp, run_ptrp);
+#endif
+  return _smal_buffer_alloc_objects(self, max_n, free_listp, run_ptrp, 0);
+}
+
+static
+size_t smal_buffer_sweep_objects(smal_buffer *self, void *alloc_ptr)
+{
+#if SMAL_SIZE_KERNELS
+  if ( smal_likely(self->type->kernel) )
+    return self->type->kernel->sweep_objects(self, alloc_ptr);
+#endif
+  return _smal_buffer_sweep_objects(self, alloc_ptr, 0);
+}
+
 static
 void smal_buffer_before_mark(smal_buffer *self)
 {
@@ -1158,6 +1559,14 @@ void smal_buffer_before_mark(smal_buffer *self)
   // Remove from type's alloc_buffer, if appropriate.
   smal_buffer_stop_allocations(self);
 
+#if SMAL_MARK_QUEUE
+  /* Drop objects greyed by smal_mark_grey() while this buffer was not in buffer_collecting. */
+  if ( self->mark_overflow ) {
+    smal_bitmap_clr_all(&self->grey_bits);
+    self->mark_overflow = 0;
+  }
+#endif
+
   /* Should this buffer be sweepable and markable this time? */
   self->markable = 
     self->sweepable = 
@@ -1165,6 +1574,30 @@ void smal_buffer_before_mark(smal_buffer *self)
      self->type->desc.collections_per_sweep == 0
      );
 
+#if SMAL_BUFFER_WRITE_BARRIER
+  smal_buffer_update_mutation(self);
+#endif
+
+#if SMAL_CARD_MARKING
+  /* Cards set since the last collection are this buffer's mutations. */
+  if ( self->cards && smal_buffer_cards_take(self, collect_minor) )
+    self->mutation = 1;
+#endif
+
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  smal_buffer_adapt_write_barrier(self);
+#endif
+
+#if SMAL_GENERATIONAL
+  /* Keep mark bits; sweep only buffers with young objects. */
+  if ( collect_minor ) {
+    self->markable = 1;
+    self->sweepable = self->young;
+    smal_buffer_before_minor_mark(self);
+  }
+  self->young = 0;
+#endif
+
   /* Prepare to re-compute live_n. */
   // smal_thread_mutex_lock(&self->stats._mutex); // Is this lock necessary? allocations have been paused. 
   self->stats.live_before_sweep_n = self->stats.live_n;
@@ -1173,31 +1606,56 @@ void smal_buffer_before_mark(smal_buffer *self)
   /* Prepare remembered_set. */
 #if SMAL_REMEMBERED_SET
   if ( self->use_remembered_set ) {
+    size_t i, n = smal_buffer_remembered_set_n(self), record_n = 0;
+
     if ( ! self->remembered_set )
-      self->remembered_set = smal_remembered_set_new(self);
+      self->remembered_set = smal_remembered_set_new(self, n);
 
     /* If buffer was mutated, its remembered set is no longer valid. */
     if ( self->mutation ) {
-      self->remembered_set_valid = 0;
+#if SMAL_WRITE_BARRIER_SLICES
+      if ( self->slice_dirty )
+	smal_buffer_slices_invalidate(self);
+      else
+#endif
+      self->remembered_set->valid = self->remembered_set_valid = 0;
       // fprintf(stderr, "  @%p remembered_set_valid = 0\n", self);
     }
 
     /* If remembered_set is not valid,
        clear it, mark through this buffer, to capture its references to other buffers. */
-    if ( ! self->remembered_set_valid )
-      self->record_remembered_set = 
-	self->markable = 1; 
-
-    if ( self->record_remembered_set )
-      smal_remembered_set_clear(self->remembered_set);
+    if ( ! self->remembered_set_valid ) {
+      for ( i = 0; i < n; ++ i ) {
+	smal_remembered_set *rs = self->remembered_set + i;
+	if ( ! rs->valid ) {
+	  rs->record = 1;
+	  smal_remembered_set_clear(rs);
+	  ++ record_n;
+	}
+      }
+      self->record_remembered_set = 1;
+#if SMAL_WRITE_BARRIER_SLICES
+      /* Scan only the objects of the invalid slices. */
+      if ( self->slice_dirty && (collect_minor || (! self->markable && record_n < n)) )
+	smal_buffer_slices_grey_recording(self, collect_minor);
+      else
+#endif
+      self->markable = 1;
+    }
   }
 #endif
 
-  if ( smal_likely(self->markable) ) {
+  if ( smal_likely(self->markable) && ! collect_minor ) {
     /* Clear mark bits. */
     smal_bitmap_clr_all(&self->mark_bits);
   }
 
+#if SMAL_BUFFER_WRITE_BARRIER
+  /* Mutations so far are accounted for above.
+     Those during this collection, which may be incremental or concurrent, are left for the next. */
+  smal_buffer_clear_mutation(self);
+#endif
+
 #if 0
   if ( self->sweepable )
     fprintf(stderr, "  @%p sweepable\n", self);
@@ -1225,7 +1683,7 @@ void smal_buffer_sweep(smal_buffer *self)
   */
   if ( smal_unlikely(self->record_remembered_set) ) {
     self->record_remembered_set = 0;
-    smal_remembered_set_finish(self->remembered_set);
+    smal_buffer_remembered_set_finish(self);
     self->remembered_set_valid = 1;
     // fprintf(stderr, "  @%p remembered_set_valid = 1 (%d)\n", self, (int) self->remembered_set->n_ptrs);
     // self->sweepable = 0;
@@ -1243,32 +1701,14 @@ void smal_buffer_sweep(smal_buffer *self)
   // fprintf(stderr, "  s_b_s(b@%p)\n", self);
 
   // smal_thread_rwlock_wrlock(&self->mark_bits_lock);
-  // smal_thread_rwlock_wrlock(&self->free_bits_lock);
-  // smal_thread_mutex_lock(&self->free_list_mutex);
 
     smal_debug(sweep, 3, "(@%p)", self);
     smal_debug(sweep, 4, "  mark_bits.set_n = %d", self->mark_bits.set_n);
 
-  {
-    void *ptr;
-    for ( ptr = self->begin_ptr; ptr < alloc_ptr; ptr += smal_buffer_object_size(self) ) {
-      if ( smal_buffer_markQ(self, ptr) ) {
-	++ live_n;
-	// fprintf(stderr, "+");
-      } else {
-	if ( smal_likely(! smal_buffer_freeQ(self, ptr)) ) {
-	  // fprintf(stderr, "-");
-	  // *(free_ptrs_p ++) = ptr;
-	  smal_buffer_free_object(self, ptr);
-	}
-      }
-    }
-  }
+  live_n = smal_buffer_sweep_objects(self, alloc_ptr);
 
   // free(free_ptrs);
 
-  //smal_thread_mutex_unlock(&self->free_list_mutex);
-  //smal_thread_rwlock_unlock(&self->free_bits_lock);
   // smal_thread_rwlock_unlock(&self->mark_bits_lock);
 
   smal_debug(sweep, 4, "  live_n = %d, stats.free_n = %d",
@@ -1293,27 +1733,28 @@ void smal_buffer_sweep(smal_buffer *self)
     smal_buffer_resume_allocations(self);
 
 #if SMAL_BUFFER_WRITE_BARRIER
-    /* Clear mutation bit and prepare write barrier. */
-    smal_buffer_clear_mutation(self);
+    /* Keep the mutation bit, set since smal_buffer_before_mark(), and prepare write barrier. */
+    if ( self->sweepable )
+      smal_buffer_write_reprotect(self);
 #endif
   } else {
+#if SMAL_BUFFER_POOL
+    smal_buffer_pool_retain(self);
+#else
     smal_buffer_free(self);
+#endif
   }
 }
 
 static
 void *_smal_collect_sweep_buffers(void *arg);
 
-void _smal_collect_inner()
+/* Pause the buffers to collect and queue the roots. */
+static
+void smal_collect_begin_mark()
 {
   smal_buffer *buf;
 
-  smal_debug(collect, 1, "()");
-
-  if ( no_collect || in_collect ) return;
-
-  if ( ! smal_thread_lock_lock(&_smal_collect_inner_lock) ) {
- 
   smal_collect_before_mark();
 
   /* Wait until allocators are done, then:
@@ -1322,6 +1763,9 @@ void _smal_collect_inner()
   */
   smal_thread_rwlock_wrlock(&alloc_lock);
 
+  /* Return objects cached by threads to their buffers before they are paused. */
+  smal_alloc_cache_flush_all();
+
   ++ in_collect;
   ++ collect_id;
 
@@ -1341,27 +1785,42 @@ void _smal_collect_inner()
     smal_buffer_before_mark(buf);
   } smal_dllist_each_end();
 
+#if SMAL_BUFFER_WRITE_BARRIER
+  /* Every buffer's soft-dirty bits were read: start tracking again before allocation resumes. */
+  if ( smal_soft_dirty )
+    smal_soft_dirty_clear();
+#endif
+
   smal_thread_rwlock_unlock(&buffer_collecting_lock);
   smal_thread_rwlock_unlock(&buffer_list_lock);
 
   /* Allocation can resume in other threads, using new blocks. */
   smal_thread_rwlock_unlock(&alloc_lock);
 
-  // Mark roots.
   ++ in_mark;
   smal_mark_queue_start();
+}
+
+static
+void smal_collect_mark_registers_and_roots()
+{
   { 
     smal_thread *thr = smal_thread_self();
     smal_mark_ptr_range(0, &thr->registers, &thr->registers + 1);
   }
   smal_collect_mark_roots();
+}
 
-  smal_mark_queue_mark_all();
-
+/* After the mark queue is drained. */
+static
+void smal_collect_end_mark()
+{
 #if SMAL_REMEMBERED_SET
+  smal_buffer *buf;
   smal_dllist_each(&buffer_collecting, buf); {
-    if ( buf->remembered_set_valid )
-      smal_remembered_set_mark(buf->remembered_set);
+    /* A minor collection does not clear the marks of remembered pointers. */
+    if ( buf->remembered_set && ! collect_minor )
+      smal_buffer_remembered_set_mark(buf);
   } smal_dllist_each_end();
 #endif
 
@@ -1374,6 +1833,29 @@ void _smal_collect_inner()
 
   /* Begin sweep. */
   smal_collect_before_sweep();
+}
+
+void _smal_collect_inner()
+{
+  smal_debug(collect, 1, "()");
+
+  if ( no_collect ) return;
+
+#if SMAL_INCREMENTAL
+  /* Finish an incremental collection. */
+  if ( collect_phase ) {
+    _smal_collect_step(0);
+    return;
+  }
+#endif
+
+  if ( in_collect ) return;
+
+  if ( ! smal_thread_lock_lock(&_smal_collect_inner_lock) ) {
+    smal_collect_begin_mark();
+    smal_collect_mark_registers_and_roots();
+    smal_mark_queue_mark_all();
+    smal_collect_end_mark();
 
 #if 0
   smal_thread_spawn_or_inline(
@@ -1388,22 +1870,10 @@ void _smal_collect_inner()
 static
 void *sweep_thread;
 
+/* With buffer_collecting_lock held and in_sweep, after sweeping buffer_collecting. */
 static
-void *_smal_collect_sweep_buffers(void *arg)
+void smal_collect_end_sweep()
 {
-  smal_buffer *buf;
-
-  // fprintf(stderr, "_smal_collect_sweep_buffers()\n");
-  sweep_thread = smal_thread_self(); // FAILS
-
-  // fprintf(stderr, "_smal_collect_sweep_buffers(): buffer_collecting_lock ++\n");
-  smal_thread_rwlock_wrlock(&buffer_collecting_lock);
-  ++ in_sweep;
-
-  smal_dllist_each(&buffer_collecting, buf); {
-    smal_buffer_sweep(buf);
-  } smal_dllist_each_end();
-
   /* Move all remaining buffers back to active buffers. */
   smal_thread_rwlock_wrlock(&buffer_list_lock);
   smal_dllist_append(&buffer_list, &buffer_collecting);
@@ -1412,20 +1882,52 @@ void *_smal_collect_sweep_buffers(void *arg)
 
   -- in_sweep;
   smal_thread_rwlock_unlock(&buffer_collecting_lock);
+
+  /* Free page map leaves emptied by sweep, if no readers hold them. */
+  smal_page_map_reclaim();
   // fprintf(stderr, "_smal_collect_sweep_buffers(): buffer_collecting_lock --\n");
 
   -- in_collect;
 
   smal_collect_after_sweep();
 
-  smal_debug(collect, 1, "  stats.alloc_n = %d, stats.live_n = %d, stats.avail_n = %d, stats.free_n = %d",
-	     buffer_head.stats.alloc_n,
-	     buffer_head.stats.live_n,
-	     buffer_head.stats.avail_n,
-	     buffer_head.stats.free_n
-	    );
+#if SMAL_BUFFER_POOL
+  smal_buffer_pool_decay();
+#endif
+
+#if SMAL_DEBUG
+  if ( smal_debug_level >= 1 ) {
+    smal_stats stats;
+    smal_global_stats(&stats);
+    smal_debug(collect, 1, "  stats.alloc_n = %d, stats.live_n = %d, stats.avail_n = %d, stats.free_n = %d",
+	       stats.alloc_n,
+	       stats.live_n,
+	       stats.avail_n,
+	       stats.free_n
+	       );
+  }
+#endif
 
   (void) smal_thread_lock_unlock(&_smal_collect_inner_lock);
+}
+
+static
+void *_smal_collect_sweep_buffers(void *arg)
+{
+  smal_buffer *buf;
+
+  // fprintf(stderr, "_smal_collect_sweep_buffers()\n");
+  sweep_thread = smal_thread_self(); // FAILS
+
+  // fprintf(stderr, "_smal_collect_sweep_buffers(): buffer_collecting_lock ++\n");
+  smal_thread_rwlock_wrlock(&buffer_collecting_lock);
+  ++ in_sweep;
+
+  smal_dllist_each(&buffer_collecting, buf); {
+    smal_buffer_sweep(buf);
+  } smal_dllist_each_end();
+
+  smal_collect_end_sweep();
 
   // fprintf(stderr, "_smal_collect_sweep_buffers(): DONE\n");
   {
@@ -1437,6 +1939,16 @@ void *_smal_collect_sweep_buffers(void *arg)
   return 0;
 }
 
+#if SMAL_INCREMENTAL
+#include "incremental.h"
+#endif
+#if SMAL_CONCURRENT_MARK
+#include "concurrent_mark.h"
+#endif
+#if SMAL_GENERATIONAL
+#include "generational.h"
+#endif
+
 void smal_collect_wait_for_sweep()
 {
   smal_thread_join(sweep_thread);
@@ -1465,6 +1977,10 @@ smal_type *smal_type_for_desc(smal_type_descriptor *desc)
     desc->free_func = null_free_func;
   if ( ! desc->collections_per_sweep )
     desc->collections_per_sweep = 1; /* sweep on every collection. */
+#if SMAL_CARD_MARKING
+  if ( desc->card_marking )
+    _smal_card_marking = 1;
+#endif
 
   smal_thread_mutex_lock(&type_head_mutex);
   smal_dllist_each(&type_head, self); {
@@ -1479,11 +1995,18 @@ smal_type *smal_type_for_desc(smal_type_descriptor *desc)
   memset(self, 0, sizeof(*self));
   self->type_id = ++ type_head.type_id;
   self->desc = *desc;
+#if SMAL_SIZE_KERNELS
+  self->kernel = smal_size_kernel_for(desc->object_size);
+#endif
   smal_dllist_init(&self->buffers);
 
   smal_thread_mutex_init(&self->stats._mutex);
   smal_thread_rwlock_init(&self->buffers_lock);
   smal_thread_mutex_init(&self->alloc_buffer_mutex);
+  if ( posix_memalign((void**) &self->stats_shards, __alignof__(self->stats_shards[0]), sizeof(self->stats_shards[0]) * smal_stats_SHARDS) )
+    abort();
+  malloc_overhead_size += sizeof(self->stats_shards[0]) * smal_stats_SHARDS;
+  memset(self->stats_shards, 0, sizeof(self->stats_shards[0]) * smal_stats_SHARDS);
   
   smal_dllist_init(self);
   smal_dllist_insert(&type_head, self);
@@ -1504,6 +2027,8 @@ smal_type *smal_type_for(size_t object_size, smal_mark_func mark_func, smal_free
 
 void smal_type_free(smal_type *self)
 {
+  smal_alloc_cache_flush_all();
+
   smal_thread_mutex_lock(&type_head_mutex);
   smal_dllist_delete(self);
   smal_thread_mutex_unlock(&type_head_mutex);
@@ -1520,10 +2045,16 @@ void smal_type_free(smal_type *self)
     smal_thread_rwlock_unlock(&self->buffers_lock);
   }
 
+#if SMAL_BUFFER_POOL
+  smal_buffer_pool_free_type(self);
+#endif
+
   smal_thread_mutex_destroy(&self->alloc_buffer_mutex);
   smal_thread_rwlock_destroy(&self->buffers_lock);
   smal_thread_mutex_destroy(&self->stats._mutex);
   
+  free(self->stats_shards);
+  malloc_overhead_size -= sizeof(self->stats_shards[0]) * smal_stats_SHARDS;
   free(self);
   malloc_overhead_size -= sizeof(*self);
 }
@@ -1570,6 +2101,10 @@ smal_buffer *smal_type_alloc_buffer(smal_type *self)
   } else {
     /* Scan for a buffer. */
     if ( ! (buf = self->alloc_buffer = smal_type_find_alloc_buffer(self)) ) {
+#if SMAL_BUFFER_POOL
+      if ( (buf = self->alloc_buffer = smal_buffer_pool_take(self)) )
+	return buf;
+#endif
       buf = self->alloc_buffer = smal_buffer_alloc(self);
       /* If 0, out-of-memory */
       // fprintf(stderr, "  type @%p buf @%p NEW\n", self, buf);
@@ -1579,6 +2114,16 @@ smal_buffer *smal_type_alloc_buffer(smal_type *self)
   return buf;
 }
 
+#if SMAL_ALLOC_CACHE
+
+void smal_alloc_p(smal_type *self, void **ptrp)
+{
+  /* No global locks unless the thread's cache needs a refill. */
+  *ptrp = smal_alloc_cache_alloc(self);
+}
+
+#else
+
 void smal_alloc_p(smal_type *self, void **ptrp)
 {
   void *ptr = 0;
@@ -1617,6 +2162,8 @@ void smal_alloc_p(smal_type *self, void **ptrp)
   *ptrp = ptr;
 }
 
+#endif
+
 /* not-thread safe. */
 void *smal_alloc(smal_type *type)
 {
@@ -1625,27 +2172,76 @@ void *smal_alloc(smal_type *type)
   return ptr;
 }
 
+size_t smal_alloc_n(smal_type *self, size_t n, void **ptrs)
+{
+  size_t i, alloc_n = 0;
+  int new_buffer = 0;
+
+  smal_thread_rwlock_rdlock(&alloc_lock);
+  smal_thread_mutex_lock(&self->alloc_buffer_mutex);
+  while ( alloc_n < n ) {
+    smal_buffer *buf;
+    void *ptr, *free_list, *run_ptr;
+    size_t buf_n;
+
+    /* If cannot allocate new smal_buffer, out-of-memory. */
+    if ( smal_unlikely(! (buf = smal_type_alloc_buffer(self))) )
+      break;
+
+    /* If current smal_buffer cannot provide, try another one once. */
+    if ( smal_unlikely(! (buf_n = smal_buffer_alloc_objects(buf, n - alloc_n, &free_list, &run_ptr))) ) {
+      self->alloc_buffer = 0;
+      if ( new_buffer ++ )
+	break;
+      continue;
+    }
+    new_buffer = 0;
+
+    smal_buffer_alloc_objects_publish(buf, buf_n);
+
+    if ( run_ptr ) {
+      for ( i = 0; i < buf_n; ++ i, run_ptr += smal_buffer_object_size(buf) )
+	ptrs[alloc_n ++] = run_ptr;
+    } else {
+      while ( (ptr = free_list) ) {
+	free_list = * (void**) ptr;
+	ptrs[alloc_n ++] = ptr;
+      }
+    }
+  }
+  smal_thread_mutex_unlock(&self->alloc_buffer_mutex);
+  smal_thread_rwlock_unlock(&alloc_lock);
+
+  smal_debug(object_alloc, 2, "(%p, %lu) = %lu", self, (unsigned long) n, (unsigned long) alloc_n);
+
+  /* Out-of-memory. */
+  for ( i = alloc_n; i < n; ++ i )
+    ptrs[i] = 0;
+
+  return alloc_n;
+}
+
 void smal_free(void *ptr)
 {
   int error = 1;
   smal_buffer *buf;
+  smal_thread *thr;
 
   smal_debug(object_free, 2, "() @%p", ptr);
 
-  if ( smal_unlikely(buf = smal_ptr_to_buffer(ptr, buffer_table)) ) {
+  thr = smal_epoch_enter();
+  buf = smal_ptr_to_buffer(ptr);
+  smal_epoch_exit(thr);
+
+  if ( smal_likely(buf) ) {
     smal_debug(object_free, 3, "ptr @%p => buf b@%p", ptr, buf);
     if ( smal_likely(smal_buffer_ptr_is_validQ(buf, ptr)) ) {
       // assert(buf->page_id == smal_buffer_page_id(buf));
       smal_debug(object_free, 3, "ptr @%p is valid in buf b@%p", ptr, buf);
 
-      smal_thread_rwlock_wrlock(&alloc_lock);
-  
-      smal_thread_mutex_lock(&buf->free_list_mutex);
-      smal_thread_rwlock_wrlock(&buf->free_bits_lock);
+      /* Only exclude the start of a collection: frees and allocations do not block each other. */
+      smal_thread_rwlock_rdlock(&alloc_lock);
       smal_buffer_free_object(buf, ptr);
-      smal_thread_rwlock_unlock(&buf->free_bits_lock);
-      smal_thread_mutex_unlock(&buf->free_list_mutex);
-
       smal_thread_rwlock_unlock(&alloc_lock);
       error = 0;
     }
@@ -1654,6 +2250,8 @@ void smal_free(void *ptr)
   if ( smal_unlikely(error) ) abort();
 }
 
+#include "size_class.h"
+
 /********************************************************************/
 
 static
@@ -1665,17 +2263,13 @@ int smal_each_object_list(smal_buffer_list_head *list, int (*func)(smal_type *ty
   smal_dllist_each(list, buf); {
     void *ptr, *alloc_ptr = smal_buffer_alloc_ptr(buf);
     // fprintf(stderr, "    s_e_o bh b@%p\n", buf);
-    smal_thread_rwlock_rdlock(&buf->free_bits_lock);
     for ( ptr = buf->begin_ptr; ptr < alloc_ptr; ptr += smal_buffer_object_size(buf) ) {
       if ( ! smal_buffer_freeQ(buf, ptr) ) {
-	smal_thread_rwlock_unlock(&buf->free_bits_lock);
 	result = func(buf->type, ptr, arg);
 	if ( smal_unlikely(result < 0) ) break;
-	smal_thread_rwlock_rdlock(&buf->free_bits_lock);
       }
     }
     if ( smal_unlikely(result < 0) ) break;
-    smal_thread_rwlock_unlock(&buf->free_bits_lock);
   } smal_dllist_each_end();
   return result;
 }
@@ -1693,6 +2287,9 @@ int smal_each_object(int (*func)(smal_type *type, void *ptr, void *arg), void *a
   /* Pause smal_collect (writer) */
   smal_thread_rwlock_rdlock(&alloc_lock);
 
+  /* Cached objects must not appear as allocated. */
+  smal_alloc_cache_flush_all();
+
   smal_thread_rwlock_rdlock(&buffer_list_lock);
   result = smal_each_object_list(&buffer_list, func, arg);
   smal_thread_rwlock_unlock(&buffer_list_lock);
@@ -1712,22 +2309,40 @@ int smal_each_object(int (*func)(smal_type *type, void *ptr, void *arg), void *a
 void smal_global_stats(smal_stats *stats)
 {
   if ( smal_unlikely(! initialized) ) smal_init();
+  smal_alloc_cache_publish_all();
   smal_thread_mutex_lock(&buffer_head.stats._mutex);
   *stats = buffer_head.stats;
-  stats->malloc_overhead_size = malloc_overhead_size;
   smal_thread_mutex_unlock(&buffer_head.stats._mutex);
+  smal_stats_sum(stats, global_stats_shards);
+  stats->malloc_overhead_size = malloc_overhead_size;
 }
 
 void smal_type_stats(smal_type *type, smal_stats *stats)
 {
+  smal_alloc_cache_publish_all();
   smal_thread_mutex_lock(&type->stats._mutex);
   *stats = type->stats;
-  smal_thread_mutex_lock(&type->stats._mutex);
+  smal_thread_mutex_unlock(&type->stats._mutex);
+  smal_stats_sum(stats, type->stats_shards);
 }
 
 /********************************************************************/
 
 static smal_thread_once _initalized = smal_thread_once_INIT;
+#if SMAL_ALLOC_CACHE || SMAL_CONCURRENT_MARK
+/* smal_thread_exit_hook */
+static
+void smal_thread_exit(smal_thread *thr)
+{
+#if SMAL_ALLOC_CACHE
+  smal_alloc_cache_thread_exit(thr);
+#endif
+#if SMAL_CONCURRENT_MARK
+  smal_satb_thread_exit(thr);
+#endif
+}
+#endif
+
 static void _initialize()
 {
   {
@@ -1752,6 +2367,44 @@ static void _initialize()
     fprintf(stderr, "\n %s:%d %s()\n", __FILE__, __LINE__, __FUNCTION__);
   }
 
+  {
+    const char *s;
+    size_t size = smal_page_size_init;
+    if ( ! size && (s = getenv("SMAL_PAGE_SIZE")) )
+      size = strtoul(s, 0, 0);
+    if ( (s = getenv("SMAL_HUGETLB")) )
+      smal_page_hugetlb = atoi(s);
+#if SMAL_GENERATIONAL
+    if ( (s = getenv("SMAL_GENERATIONAL")) )
+      smal_generational = atoi(s);
+#endif
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+    if ( (s = getenv("SMAL_WRITE_BARRIER_ADAPT")) )
+      smal_write_barrier_adapt = atoi(s);
+#endif
+#if SMAL_PARALLEL_MARK
+    if ( (s = getenv("SMAL_MARK_THREADS")) )
+      smal_mark_threads = atoi(s);
+    if ( smal_mark_threads < 1 )
+      smal_mark_threads = 1;
+#endif
+    if ( ! size )
+      size = smal_page_size_default;
+#if SMAL_PAGE_SIZE_FIXED
+    if ( size != smal_page_size ) {
+      fprintf(stderr, "SMAL: SMAL_PAGE_SIZE_FIXED: ignoring page size %lu\n", (unsigned long) size);
+    }
+#else
+    if ( (size & (size - 1)) || size < (size_t) getpagesize() ) {
+      fprintf(stderr, "SMAL: invalid page size %lu: using %lu\n", (unsigned long) size, (unsigned long) smal_page_size_default);
+      size = smal_page_size_default;
+    }
+    smal_page_size = size;
+    smal_page_mask = size - 1;
+    smal_page_shift = __builtin_ctzl(size);
+#endif
+  }
+
   memset(&buffer_head, 0, sizeof(buffer_head));
   smal_dllist_init(&buffer_head);
 
@@ -1766,7 +2419,14 @@ static void _initialize()
 
   smal_thread_mutex_init(&_smal_debug_mutex);
   smal_thread_rwlock_init(&alloc_lock);
+#if SMAL_ALLOC_CACHE
+  smal_thread_rwlock_init(&alloc_cache_lock);
+#endif
   smal_thread_mutex_init(&type_head_mutex);
+  smal_thread_mutex_init(&size_class_mutex);
+#if SMAL_ARENA
+  smal_thread_mutex_init(&arena_mutex);
+#endif
   smal_thread_rwlock_init(&buffer_head_lock);
   smal_thread_mutex_init(&buffer_head.stats._mutex);
   smal_thread_rwlock_init(&buffer_list_lock);
@@ -1774,25 +2434,16 @@ static void _initialize()
 
   smal_thread_lock_init(&_smal_collect_inner_lock);
 
-  page_id_min = 0; page_id_max = 0;
-  page_id_min_max_valid = 0;
-
-  buffer_table_size = 1;
-  {
-    size_t size = sizeof(buffer_table[0]) * buffer_table_size;
-    buffer_table =   malloc(size);
-    memset(buffer_table, 0, size);
-    malloc_overhead_size += size;
-  }
-  smal_thread_rwlock_init(&buffer_table_lock);
-
-  buffer_table_mark = buffer_table;
-  buffer_table_mark_size = buffer_table_size;
+  smal_page_map_init();
 
 #if SMAL_BUFFER_WRITE_BARRIER
   smal_buffer_write_barrier_init();
 #endif
 
+#if SMAL_ALLOC_CACHE || SMAL_CONCURRENT_MARK
+  smal_thread_exit_hook = smal_thread_exit;
+#endif
+
   initialized = 1;
 
   if ( smal_debug_level >= 1 ) {
@@ -1816,6 +2467,10 @@ void smal_shutdown()
   ++ no_collect;
   ++ in_shutdown;
 
+  smal_alloc_cache_flush_all();
+  smal_alloc_cache_free_all();
+  smal_size_class_free_all();
+
   smal_dllist_each(&buffer_list, buf); {
     smal_buffer_free(buf);
   } smal_dllist_each_end();
@@ -1824,17 +2479,21 @@ void smal_shutdown()
     smal_type_free(type);
   } smal_dllist_each_end();
 
-  if ( buffer_table_mark && buffer_table_mark != buffer_table ) {
-    free(buffer_table_mark);
-    malloc_overhead_size -= sizeof(buffer_table_mark[0]) * buffer_table_mark_size;
-  }
-  buffer_table_mark = 0;
-  buffer_table_mark_size = 0;
+#if SMAL_PARALLEL_MARK
+  smal_mark_workers_stop();
+#endif
+#if SMAL_CONCURRENT_MARK
+  smal_satb_free_all();
+#endif
+#if SMAL_MARK_QUEUE
+  smal_mark_queue_pool_free();
+#endif
+
+  smal_page_map_free();
 
-  free(buffer_table);
-  malloc_overhead_size -= sizeof(buffer_table[0]) * buffer_table_size;
-  buffer_table = 0;
-  buffer_table_size = 0;
+#if SMAL_ARENA
+  smal_arena_free_all();
+#endif
 
   {
     static smal_thread_once zero = smal_thread_once_INIT;
@@ -12,6 +12,10 @@
 #include <string.h> /* memset() */
 #include <stdio.h>
 
+#ifdef smal_thread_self
+#undef smal_thread_self
+#endif
+
 #ifdef smal_thread_mutex_init
 #undef smal_thread_mutex_init
 #undef smal_thread_mutex_destroy
@@ -37,7 +41,10 @@ void mutex_stats()
 #endif
 
 static int thread_inited;
-static smal_thread thread_main;
+smal_thread _smal_thread_main;
+#define thread_main _smal_thread_main
+
+void (*smal_thread_exit_hook)(smal_thread *t);
 
 static
 int _smal_thread_getstack_main(smal_thread *t, void **addrp, size_t *sizep)
@@ -83,10 +90,20 @@ void thread_exit(void *arg)
 }
 #endif
 
+static
+void thread_key_destroy(void *arg)
+{
+  smal_thread *t = arg;
+  if ( t && smal_thread_exit_hook )
+    smal_thread_exit_hook(t);
+}
+
 static
 void thread_init(smal_thread* t)
 {
+  static size_t thread_id;
   memset(t, 0, sizeof(*t));
+  t->id = __sync_fetch_and_add(&thread_id, 1);
   t->thread = pthread_self();
   pthread_setspecific(roots_key, t);
 
@@ -132,7 +149,7 @@ static
 void _smal_thread_init()
 {
   if ( ! thread_inited ) {
-    pthread_key_create(&roots_key, 0);
+    pthread_key_create(&roots_key, thread_key_destroy);
 
     pthread_rwlock_init(&thread_list_lock, 0);
     
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* REG_* */
+#endif
 #include "smal/smal.h"
 #include "smal/thread.h"
 #include "arch.h"
@@ -6,13 +9,69 @@ extern void _smal_collect_inner();
 
 extern void smal_collect_before_inner(void *top_of_stack);
 
+/* Save registers for conservative scanning. */
+#define smal_collect_save_registers(thr)				\
+  do {									\
+    smal_FLUSH_REGISTER_WINDOWS;					\
+    setjmp((thr)->registers._jb);					\
+    getcontext(&(thr)->registers._ucontext);				\
+    smal_CLEAR_CALLER_SAVED_REGISTERS(&(thr)->registers._ucontext);	\
+  } while ( 0 )
+
 void smal_collect()
 {
   smal_thread *thr = smal_thread_self();
   void *top_of_stack = 0;
-  smal_FLUSH_REGISTER_WINDOWS;
-  setjmp(thr->registers._jb);
-  getcontext(&thr->registers._ucontext);
+  smal_collect_save_registers(thr);
   smal_collect_before_inner(&top_of_stack);
   _smal_collect_inner();
 }
+
+#if SMAL_GENERATIONAL
+extern void _smal_collect_minor();
+
+void smal_collect_minor()
+{
+  smal_thread *thr = smal_thread_self();
+  void *top_of_stack = 0;
+  smal_collect_save_registers(thr);
+  smal_collect_before_inner(&top_of_stack);
+  _smal_collect_minor();
+}
+#endif
+
+#if SMAL_INCREMENTAL
+extern int _smal_collect_start();
+extern int _smal_collect_step(unsigned long budget_ns);
+
+int smal_collect_start()
+{
+  smal_thread *thr = smal_thread_self();
+  void *top_of_stack = 0;
+  smal_collect_save_registers(thr);
+  smal_collect_before_inner(&top_of_stack);
+  return _smal_collect_start();
+}
+
+int smal_collect_step(unsigned long budget_ns)
+{
+  smal_thread *thr = smal_thread_self();
+  void *top_of_stack = 0;
+  smal_collect_save_registers(thr);
+  smal_collect_before_inner(&top_of_stack);
+  return _smal_collect_step(budget_ns);
+}
+#endif
+
+#if SMAL_CONCURRENT_MARK
+extern int _smal_collect_start_concurrent();
+
+int smal_collect_start_concurrent()
+{
+  smal_thread *thr = smal_thread_self();
+  void *top_of_stack = 0;
+  smal_collect_save_registers(thr);
+  smal_collect_before_inner(&top_of_stack);
+  return _smal_collect_start_concurrent();
+}
+#endif
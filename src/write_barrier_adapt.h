@@ -0,0 +1,122 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+/* Optionally included directly into smal.c */
+
+/*
+  Adaptive write barrier.
+
+  A buffer tracking mutation that is mutated in smal_write_barrier_adapt consecutive collections
+  stops tracking: it is no longer write-protected, and does not fault on every collection.
+  A buffer of a mostly_unchanging type drops its remembered set and is marked on every collection.
+
+  A buffer not tracking mutation cannot tell whether it stays clean:
+  after smal_write_barrier_adapt << write_barrier_backoff collections it tracks mutation again.
+  write_barrier_backoff is incremented each time the buffer stops tracking,
+  and cleared when it stays clean for smal_write_barrier_adapt collections.
+
+  Buffers of other types start tracking only during smal_collect_minor(),
+  which then skips their old objects while they are clean.
+
+  Buffers with cards are not adapted.  Decisions are counted in the
+  write_barrier_disables and write_barrier_enables stats.
+*/
+
+#ifndef smal_write_barrier_BACKOFF_MAX
+#define smal_write_barrier_BACKOFF_MAX 6
+#endif
+
+int smal_write_barrier_adapt = 4;
+
+/* Start tracking mutation; assume the whole buffer was mutated. */
+static
+void smal_buffer_write_barrier_enable(smal_buffer *self)
+{
+  self->mutation_write_barrier = 1;
+#if SMAL_REMEMBERED_SET
+  self->use_remembered_set = self->type->desc.mostly_unchanging;
+#endif
+#if SMAL_WRITE_BARRIER_SLICES
+  if ( ! self->slice_dirty )
+    smal_buffer_slices_init(self);
+  memset(self->slice_dirty, 1, self->slice_n);
+#endif
+  self->mutation = 1;
+  self->write_barrier_adapted -= 1;
+}
+
+/* Stop tracking mutation. */
+static
+void smal_buffer_write_barrier_disable(smal_buffer *self)
+{
+  self->mutation_write_barrier = 0;
+  smal_buffer_write_unprotect(self);
+#if SMAL_REMEMBERED_SET
+  if ( self->use_remembered_set ) {
+    size_t i, n = smal_buffer_remembered_set_n(self);
+    self->use_remembered_set = 0;
+    if ( self->remembered_set )
+      for ( i = 0; i < n; ++ i )
+	self->remembered_set[i].valid = 0;
+    self->remembered_set_valid = 0;
+  }
+#endif
+  self->write_barrier_adapted += 1;
+}
+
+/* Before marking, after the mutation flag is current. */
+static
+void smal_buffer_adapt_write_barrier(smal_buffer *self)
+{
+  int k = smal_write_barrier_adapt;
+
+  if ( ! k || self->mmap_size != smal_page_size )
+    return;
+#if SMAL_CARD_MARKING
+  if ( self->cards )
+    return;
+#endif
+
+  if ( self->mutation_write_barrier ) {
+    if ( ! self->mutation ) {
+      if ( (self->mutation_run = (self->mutation_run < 0 ? self->mutation_run : 0) - 1) <= - k )
+	self->write_barrier_backoff = 0;
+      return;
+    }
+    if ( (self->mutation_run = (self->mutation_run > 0 ? self->mutation_run : 0) + 1) < k )
+      return;
+    smal_debug(write_barrier, 1, " b@%p disable after %d mutations", self, self->mutation_run);
+    smal_buffer_write_barrier_disable(self);
+    self->mutation_run = 0;
+    if ( self->write_barrier_backoff < smal_write_barrier_BACKOFF_MAX )
+      ++ self->write_barrier_backoff;
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(write_barrier_disables, += 1);
+    smal_LOCK_STATS(unlock);
+  } else if ( (self->type->desc.mostly_unchanging || collect_minor) &&
+	      ++ self->mutation_run >= (k << self->write_barrier_backoff) ) {
+    smal_debug(write_barrier, 1, " b@%p enable after %d collections", self, self->mutation_run);
+    smal_buffer_write_barrier_enable(self);
+    self->mutation_run = 0;
+    smal_LOCK_STATS(lock);
+    smal_UPDATE_STATS(write_barrier_enables, += 1);
+    smal_LOCK_STATS(unlock);
+  }
+
+  /* Without a remembered set, references from this buffer are found only by marking it. */
+  if ( self->type->desc.mostly_unchanging && ! self->mutation_write_barrier )
+    self->markable = 1;
+}
+
+/* Undo adaptations of a buffer retained for reuse. */
+static
+void smal_buffer_adapt_reset(smal_buffer *self)
+{
+  if ( self->write_barrier_adapted > 0 )
+    smal_buffer_write_barrier_enable(self);
+  else if ( self->write_barrier_adapted < 0 )
+    smal_buffer_write_barrier_disable(self);
+  self->mutation_run = self->write_barrier_backoff = 0;
+}
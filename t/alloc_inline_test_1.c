@@ -0,0 +1,72 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+static
+int count_object(smal_type *type, void *ptr, void *arg)
+{
+  (* (int *) arg) ++;
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x, *y;
+  int i, n = 100000;
+  smal_roots_2(x, y);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = 0;
+  for ( i = 0; i < n; ++ i ) {
+    y = smal_alloc_inline(my_cons_type);
+    assert(y);
+    y->car = (my_oop) 0;
+    y->cdr = x;
+    x = y;
+    if ( i % 1000 == 0 )
+      smal_collect();
+  }
+  y = 0;
+
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.alloc_id == n);
+  }
+
+  smal_collect();
+  {
+    int obj_count = 0;
+    smal_each_object(count_object, &obj_count);
+    {
+      smal_stats stats = { 0 };
+      smal_global_stats(&stats);
+      assert(stats.live_n == n);
+    }
+    assert(obj_count == n);
+  }
+
+  /* Allocate after everything was collected. */
+  x = 0;
+  smal_collect();
+  for ( i = 0; i < n; ++ i ) {
+    y = smal_alloc_inline(my_cons_type);
+    assert(y);
+  }
+  y = 0;
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.alloc_id == n * 2);
+    assert(stats.live_n == n);
+  }
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,84 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+static
+int count_object(smal_type *type, void *ptr, void *arg)
+{
+  (* (int *) arg) ++;
+  return 0;
+}
+
+#define N 10000
+
+static void *ptrs[N];
+
+int main(int argc, char **argv)
+{
+  my_cons *x, *y;
+  size_t i, n;
+  smal_roots_2(x, y);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  n = smal_alloc_n(my_cons_type, N, ptrs);
+  assert(n == N);
+
+  /* Link all objects into one list rooted by x. */
+  x = 0;
+  for ( i = 0; i < n; ++ i ) {
+    y = ptrs[i];
+    assert(y);
+    y->car = 0;
+    y->cdr = x;
+    x = y;
+    ptrs[i] = 0;
+  }
+  y = 0;
+
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.alloc_id == N);
+    assert(stats.live_n == N);
+  }
+
+  /* Unroot half, then allocate into the swept free lists. */
+  for ( i = 0, y = x; i < N / 2 - 1; ++ i )
+    y = y->cdr;
+  y->cdr = 0;
+  y = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == N / 2);
+    assert(stats.free_n > 0 && stats.free_n <= N / 2); /* empty buffers are unmapped. */
+  }
+
+  n = smal_alloc_n(my_cons_type, N, ptrs);
+  assert(n == N);
+  {
+    int obj_count = 0;
+    smal_stats stats = { 0 };
+    smal_each_object(count_object, &obj_count);
+    smal_global_stats(&stats);
+    assert(stats.alloc_id == N * 2);
+    assert(stats.live_n == N / 2 + N);
+    assert(stats.free_n == 0);
+    assert(obj_count == stats.live_n);
+  }
+
+  for ( i = 0; i < N; ++ i )
+    ptrs[i] = 0;
+  x = 0;
+  smal_collect();
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
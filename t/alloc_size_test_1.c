@@ -0,0 +1,79 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+#include <string.h>
+
+static
+size_t object_size(void *ptr)
+{
+  smal_buffer *buf = smal_buffer_from_ptr(ptr);
+  assert(buf);
+  return buf->object_size;
+}
+
+int main(int argc, char **argv)
+{
+  char *x, *y;
+  size_t size, i;
+  smal_roots_2(x, y);
+
+  /* Size classes bound internal fragmentation. */
+  for ( size = 1; size <= 8000; size += size < 300 ? 1 : 37 ) {
+    x = smal_alloc_size(size, 0, 0);
+    assert(x);
+    assert(object_size(x) >= size);
+    if ( size <= smal_page_size / 2 )
+      assert(object_size(x) - size < 8 || object_size(x) - size <= object_size(x) / 4);
+    memset(x, 1, size);
+  }
+
+  /* Same-size requests share a smal_type. */
+  x = smal_alloc_size(100, 0, 0);
+  y = smal_alloc_size(97, 0, 0);
+  assert(smal_buffer_from_ptr(x)->type == smal_buffer_from_ptr(y)->type);
+
+  /* Shares the smal_type with an equivalent smal_type_for(). */
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+  x = smal_alloc_size(sizeof(my_cons), my_cons_mark, 0);
+  assert(smal_buffer_from_ptr(x)->type == my_cons_type);
+
+  /* Larger than a page: served by a large object span. */
+  x = smal_alloc_size(smal_page_size * 2, 0, 0);
+  assert(x);
+  assert(object_size(x) >= smal_page_size * 2);
+
+  /* smal_realloc() stays in place within a size class. */
+  x = smal_alloc_size(100, 0, 0);
+  for ( i = 0; i < 100; ++ i ) x[i] = i;
+  y = smal_realloc(x, 102);
+  assert(y == x);
+
+  /* Otherwise, moves. */
+  y = smal_realloc(x, 1000);
+  assert(y != x);
+  assert(object_size(y) >= 1000);
+  for ( i = 0; i < 100; ++ i ) assert(y[i] == (char) i);
+  x = 0;
+
+  /* Shrinks. */
+  x = smal_realloc(y, 10);
+  assert(object_size(x) == 16);
+  for ( i = 0; i < 10; ++ i ) assert(x[i] == (char) i);
+  y = 0;
+
+  x = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == 0);
+  }
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
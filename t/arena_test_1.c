@@ -0,0 +1,72 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 100000
+
+int main(int argc, char **argv)
+{
+  my_cons *x, *y;
+  size_t i;
+#if SMAL_ARENA
+  void *lo = 0, *hi = 0;
+#endif
+  smal_roots_2(x, y);
+
+  smal_page_size_init = 16 * 1024;
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = 0;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = 0;
+    y->cdr = x;
+    x = y;
+  }
+
+#if SMAL_ARENA
+  /* Buffers are carved from one reservation, without holes. */
+  {
+    smal_stats stats = { 0 };
+    for ( y = x; y; y = y->cdr ) {
+      smal_buffer *buf = smal_buffer_from_ptr(y);
+      assert(buf);
+      assert(smal_addr_page_offset(buf->mmap_addr) == 0);
+      if ( ! lo || buf->mmap_addr < lo ) lo = buf->mmap_addr;
+      if ( buf->mmap_addr > hi ) hi = buf->mmap_addr;
+    }
+    smal_global_stats(&stats);
+    assert(stats.buffer_n > 1);
+    assert(hi - lo == (stats.buffer_n - 1) * smal_page_size);
+  }
+#endif
+
+  y = 0;
+  smal_collect();
+  x = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == 0);
+    assert(stats.buffer_n == 0);
+  }
+
+#if SMAL_ARENA
+  /* Freed pages are reused and read as zero. */
+  x = smal_alloc(my_cons_type);
+  {
+    smal_buffer *buf = smal_buffer_from_ptr(x);
+    assert(lo <= buf->mmap_addr && buf->mmap_addr <= hi);
+    assert(x->car == 0 && x->cdr == 0);
+  }
+#endif
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
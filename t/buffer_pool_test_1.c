@@ -0,0 +1,101 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 10000
+
+static
+my_cons *make_list()
+{
+  my_cons *x = 0, *y;
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = 0;
+    y->cdr = x;
+    x = y;
+  }
+  return x;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0;
+#if SMAL_BUFFER_POOL
+  size_t mmap_size;
+#endif
+  smal_roots_1(x);
+
+  smal_page_size_init = 16 * 1024;
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+#if SMAL_BUFFER_POOL
+  smal_buffer_pool_decommit_secs = smal_buffer_pool_unmap_secs = -1;
+
+  x = make_list();
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.buffer_n > 1);
+    assert(stats.retained_size == 0);
+    mmap_size = stats.mmap_size;
+  }
+
+  /* Empty buffers are retained, not unmapped. */
+  x = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == 0);
+    assert(stats.buffer_n == 0);
+    assert(stats.mmap_size == 0);
+    assert(stats.retained_size == mmap_size);
+  }
+
+  /* Retained buffers are reused before new ones are mapped. */
+  x = make_list();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.mmap_size == mmap_size);
+    assert(stats.retained_size == 0);
+    assert(stats.mmap_total == mmap_size * 2);
+    assert(stats.live_n + stats.alloc_n >= N);
+  }
+
+  /* Idle retained buffers are decommitted, then unmapped. */
+  x = 0;
+  smal_buffer_pool_decommit_secs = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.buffer_n == 0);
+    assert(stats.retained_size == mmap_size);
+    assert(stats.decommitted_size == mmap_size);
+  }
+
+  x = make_list();
+  assert(((my_cons*) x->cdr)->car == 0);
+  smal_collect();
+  x = 0;
+  smal_buffer_pool_unmap_secs = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.buffer_n == 0);
+    assert(stats.retained_size == 0);
+    assert(stats.decommitted_size == 0);
+  }
+#endif
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+#include <time.h>
+
+#define N 20000
+#define STRIDE 16 /* Mutate every STRIDE-th cons. */
+#define ROUNDS 20
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+static
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+size_t mutations(smal_type *type)
+{
+  smal_stats stats = { 0 };
+  smal_type_stats(type, &stats);
+  return stats.buffer_mutations;
+}
+
+static
+smal_type *make_type(int card_marking, int mostly_unchanging)
+{
+  smal_type_descriptor desc;
+  memset(&desc, 0, sizeof(desc));
+  desc.object_size = sizeof(my_cons);
+  desc.mark_func = my_cons_mark;
+  desc.mostly_unchanging = mostly_unchanging;
+  desc.card_marking = card_marking;
+  return smal_type_for_desc(&desc);
+}
+
+static
+my_cons *make_list(smal_type *type)
+{
+  my_cons *x = 0, *y;
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(type);
+    y->car = TAG(i);
+    y->cdr = x;
+    x = y;
+  }
+  return x;
+}
+
+/* Cars of mutated conses are my_cons_type conses holding a TAG(). */
+static
+size_t check_list(my_cons *x)
+{
+  size_t i, n = 0;
+  for ( i = 0; x; x = x->cdr, ++ i ) {
+    if ( i % STRIDE == 0 )
+      assert(((size_t) ((my_cons*) x->car)->car) & 1);
+    else
+      assert(((size_t) x->car) & 1);
+    ++ n;
+  }
+  return n;
+}
+
+/* Time mutating every STRIDE-th car of a list of type, then collecting. */
+static
+double bench(smal_type *type, my_cons **xp)
+{
+  my_cons *y;
+  size_t r, i;
+  double t0;
+
+  *xp = make_list(type);
+  smal_collect();
+  t0 = now();
+  for ( r = 0; r < ROUNDS; ++ r ) {
+    for ( y = *xp, i = 0; y; y = y->cdr, ++ i ) {
+      if ( i % STRIDE == 0 )
+	smal_write_barrier(y, &y->car, TAG(r));
+    }
+    smal_collect();
+  }
+  t0 = now() - t0;
+  *xp = 0;
+  return t0;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0, *z = 0;
+  smal_type *card_type, *card_mu_type, *fault_type;
+  size_t i, m;
+  smal_roots_3(x, y, z);
+
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  /* Compare the barriers as configured. */
+  smal_write_barrier_adapt = 0;
+#endif
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+#if SMAL_CARD_MARKING
+  /* smal_write_barrier() looks up cards only once there are card_marking types. */
+  assert(! _smal_card_marking);
+#endif
+  card_type = make_type(1, 0);
+#if SMAL_CARD_MARKING
+  assert(_smal_card_marking);
+#endif
+  card_mu_type = make_type(1, 1);
+  fault_type = make_type(0, 1);
+
+  x = make_list(card_type);
+  smal_collect();
+  assert(live_n() == N);
+
+  /* No stores: no mutations. */
+  m = mutations(card_type);
+  smal_collect();
+  assert(mutations(card_type) == m);
+
+  /* Store pointers to new objects into old objects. */
+  for ( y = x, i = 0; y; y = y->cdr, ++ i ) {
+    if ( i % STRIDE == 0 ) {
+      z = smal_alloc(my_cons_type);
+      z->car = TAG(i); z->cdr = 0;
+      smal_write_barrier(y, &y->car, z);
+      z = 0;
+      /* Garbage. */
+      smal_alloc(my_cons_type);
+    }
+  }
+#if SMAL_CARD_MARKING
+#if SMAL_GENERATIONAL
+  smal_collect_minor();
+  assert(live_n() == N + N / STRIDE);
+  assert(check_list(x) == N);
+#endif
+  smal_collect();
+  assert(mutations(card_type) > m);
+#endif
+  assert(live_n() == N + N / STRIDE);
+  assert(check_list(x) == N);
+
+  x = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+  /* Cards invalidate remembered sets of mostly_unchanging types. */
+  x = make_list(card_mu_type);
+  smal_collect();
+  m = mutations(card_mu_type);
+  smal_write_barrier(x, &x->car, TAG(1));
+  smal_collect();
+#if SMAL_CARD_MARKING
+  assert(mutations(card_mu_type) == m + 1);
+#endif
+  x = 0;
+
+  fprintf(stderr, "  fault: %.3f sec\n", bench(fault_type, &x));
+  fprintf(stderr, "  card:  %.3f sec\n", bench(card_mu_type, &x));
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,220 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+#include <sched.h> /* sched_yield() */
+
+#define N 20000
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+/* A list of N conses, each car is a cons whose car is a TAG(). */
+static
+my_cons *make_list()
+{
+  my_cons *x = 0, *y, *z;
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    z = smal_alloc(my_cons_type);
+    z->car = TAG(i); z->cdr = 0;
+    y = smal_alloc(my_cons_type);
+    y->car = z;
+    y->cdr = x;
+    x = y;
+    /* Garbage. */
+    smal_alloc(my_cons_type);
+  }
+  return x;
+}
+
+static
+size_t check_list(my_cons *x)
+{
+  size_t n = 0;
+  for ( ; x; x = x->cdr ) {
+    my_cons *z = x->car;
+    assert(((size_t) z->car) & 1);
+    ++ n;
+  }
+  return n;
+}
+
+#if SMAL_CONCURRENT_MARK
+/* Move the car of the last list element into a new cons,
+   then overwrite every reference to it: it is reachable only through the SATB log. */
+static
+void move_last(my_cons *x, my_cons **movedp)
+{
+  my_cons *y, *last, *z;
+  for ( y = x; y->cdr && ((my_cons*) y->cdr)->cdr; y = y->cdr )
+    ;
+  if ( (last = y->cdr) ) {
+    z = smal_alloc(my_cons_type);
+    z->car = z->cdr = 0;
+    smal_write_barrier(z, &z->car, last->car);
+    smal_write_barrier(z, &z->cdr, *movedp);
+    *movedp = z;
+    smal_write_barrier(last, &last->car, 0);
+    smal_write_barrier(y, &y->cdr, 0);
+  }
+}
+#endif
+
+#if SMAL_CONCURRENT_MARK && SMAL_PTHREAD
+#define SWAP_N 10000
+static volatile int swap_state; /* 1: list built, 2: stop. */
+
+/* Swap the cars of random list elements, while the main thread collects. */
+static
+void *swap_thread(void *arg)
+{
+  my_cons *x = 0, *a = 0, *b = 0;
+  void *tmp = 0;
+  size_t i, j, sum = 0, r = 1;
+  smal_roots_4(x, a, b, tmp);
+
+  for ( i = 0; i < SWAP_N; ++ i ) {
+    a = smal_alloc(my_cons_type);
+    a->car = TAG(i); a->cdr = 0;
+    b = smal_alloc(my_cons_type);
+    b->car = a; b->cdr = x;
+    x = b;
+  }
+  swap_state = 1;
+
+  while ( swap_state != 2 ) {
+    r = r * 1103515245 + 12345;
+    for ( a = x, j = (r >> 8) % SWAP_N; j --; a = a->cdr )
+      ;
+    for ( b = x, j = (r >> 20) % SWAP_N; j --; b = b->cdr )
+      ;
+    /* A collection may start between the stores. */
+    tmp = a->car;
+    smal_write_barrier(a, &a->car, b->car);
+    smal_write_barrier(b, &b->car, tmp);
+    tmp = 0;
+  }
+
+  for ( a = x, i = 0; a; a = a->cdr, ++ i ) {
+    b = a->car;
+    assert(((size_t) b->car) & 1);
+    sum += (size_t) b->car >> 1;
+  }
+  assert(i == SWAP_N);
+  assert(sum == SWAP_N * (SWAP_N - 1) / 2);
+
+  smal_roots_end();
+  return arg;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0, *moved = 0, *h = 0;
+  size_t n;
+#if SMAL_CONCURRENT_MARK
+  size_t steps = 0;
+  int i;
+#endif
+  smal_roots_4(x, y, moved, h);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = make_list();
+  smal_collect();
+  assert(live_n() == N * 2);
+
+#if SMAL_CONCURRENT_MARK
+  assert(smal_collect_start_concurrent());
+  assert(! smal_collect_start_concurrent());
+  /* Likely before the marker reaches the end of the list. */
+  for ( i = 0; i < 100; ++ i )
+    move_last(x, &moved);
+  while ( smal_collect_step(20000) ) {
+    ++ steps;
+    move_last(x, &moved);
+  }
+  fprintf(stderr, "steps = %lu\n", (unsigned long) steps);
+  assert(steps > 0);
+#endif
+
+  n = check_list(x);
+  for ( y = moved; y; y = y->cdr ) {
+    my_cons *z = y->car;
+    assert(((size_t) z->car) & 1);
+    ++ n;
+  }
+  y = 0;
+  assert(n == N);
+
+  /* Collect floating garbage. */
+  smal_collect();
+  assert(live_n() == N * 2);
+
+  x = moved = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+#if SMAL_CONCURRENT_MARK && SMAL_BUFFER_WRITE_BARRIER
+  /* A store into an old object during a collection is a mutation for the next one. */
+  {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = sizeof(my_cons);
+    desc.mark_func = my_cons_mark;
+    desc.mostly_unchanging = 1;
+    desc.collections_per_sweep = 1000;
+    h = smal_alloc(smal_type_for_desc(&desc));
+    h->car = h->cdr = 0;
+  }
+  smal_collect();
+  smal_collect();
+  assert(smal_collect_start_concurrent());
+  y = smal_alloc(my_cons_type);
+  y->car = TAG(1); y->cdr = 0;
+  smal_write_barrier(h, &h->car, y);
+  y = 0;
+  while ( smal_collect_step(20000) )
+    ;
+  smal_collect();
+  assert(live_n() == 2);
+  for ( n = 0; n < N; ++ n ) {
+    y = smal_alloc(my_cons_type);
+    y->car = y->cdr = 0;
+  }
+  y = 0;
+  assert(((my_cons*) h->car)->car == TAG(1));
+  h = 0;
+#endif
+
+#if SMAL_CONCURRENT_MARK && SMAL_PTHREAD
+  /* Another thread stores pointers while marking is finished. */
+  {
+    pthread_t t;
+    /* Keep the marker busy. */
+    x = make_list();
+    assert(pthread_create(&t, 0, swap_thread, 0) == 0);
+    while ( swap_state != 1 )
+      sched_yield();
+    for ( i = 0; i < 20; ++ i ) {
+      assert(smal_collect_start_concurrent());
+      smal_collect();
+      for ( n = 0; n < N / 10; ++ n ) {
+	y = smal_alloc(my_cons_type);
+	y->car = y->cdr = 0;
+      }
+      y = 0;
+    }
+    swap_state = 2;
+    assert(pthread_join(t, 0) == 0);
+    assert(check_list(x) == N);
+    x = 0;
+  }
+#endif
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 10000
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+/* A list of n conses, each car is a cons whose car is a TAG(). */
+static
+my_cons *make_list(size_t n)
+{
+  my_cons *x = 0, *y, *z;
+  size_t i;
+  for ( i = 0; i < n; ++ i ) {
+    z = smal_alloc(my_cons_type);
+    z->car = TAG(i); z->cdr = 0;
+    y = smal_alloc(my_cons_type);
+    y->car = z;
+    y->cdr = x;
+    x = y;
+    /* Garbage. */
+    smal_alloc(my_cons_type);
+  }
+  return x;
+}
+
+static
+size_t check_list(my_cons *x)
+{
+  size_t n = 0;
+  for ( ; x; x = x->cdr ) {
+    my_cons *z = x->car;
+    assert(((size_t) z->car) & 1);
+    ++ n;
+  }
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0;
+  smal_roots_2(x, y);
+
+#if SMAL_SOFT_DIRTY
+  /* Counts mutations as they fault. */
+  smal_soft_dirty = 0;
+#endif
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  smal_write_barrier_adapt = 0;
+#endif
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  /* Old. */
+  x = make_list(N);
+  smal_collect();
+  assert(live_n() == N * 2);
+  assert(check_list(x) == N);
+
+#if SMAL_GENERATIONAL
+  /* Young. */
+  y = make_list(N);
+  smal_collect_minor();
+  assert(live_n() == N * 4);
+  assert(check_list(y) == N);
+
+  /* The first minor collection puts old buffers under the write barrier. */
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(smal_generational);
+#endif
+
+  /* Old objects referring to young objects. */
+  {
+    my_cons *z;
+#if SMAL_BUFFER_WRITE_BARRIER
+    smal_stats s0 = { 0 }, s1 = { 0 };
+    smal_global_stats(&s0);
+    * (my_oop volatile *) &x->cdr = x->cdr;
+    smal_global_stats(&s1);
+    assert(s1.buffer_mutations == s0.buffer_mutations + 1);
+#endif
+    for ( z = x; z; z = z->cdr ) {
+      my_cons *w = smal_alloc(my_cons_type);
+      w->car = ((my_cons*) z->car)->car; w->cdr = 0;
+      z->car = w;
+      /* Garbage. */
+      smal_alloc(my_cons_type);
+    }
+  }
+  smal_collect_minor();
+#if SMAL_BUFFER_WRITE_BARRIER
+  /* The old objects x referred to are old garbage. */
+  assert(live_n() == N * 5);
+#endif
+  assert(check_list(x) == N);
+
+  /* Old garbage survives minor collections. */
+  x = 0;
+  smal_collect_minor();
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(live_n() == N * 5);
+#endif
+  smal_collect();
+  assert(live_n() == N * 2);
+  assert(check_list(y) == N);
+#endif
+
+  x = y = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+#if SMAL_GENERATIONAL && SMAL_INCREMENTAL
+  /* Objects allocated during a collection and given back unused are young when allocated again. */
+  {
+    size_t i, n;
+    assert(smal_collect_start());
+    x = make_list(1);
+    while ( smal_collect_step(0) )
+      ;
+    smal_collect_minor();
+    n = live_n();
+    for ( i = 0; i < 50; ++ i )
+      smal_alloc(my_cons_type);
+    smal_collect_minor();
+    assert(live_n() == n);
+    assert(check_list(x) == 1);
+  }
+  x = 0;
+  smal_collect();
+  assert(live_n() == 0);
+#endif
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,159 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 20000
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+/* A list of N conses, each car is a cons whose car is a TAG(). */
+static
+my_cons *make_list()
+{
+  my_cons *x = 0, *y, *z;
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    z = smal_alloc(my_cons_type);
+    z->car = TAG(i); z->cdr = 0;
+    y = smal_alloc(my_cons_type);
+    y->car = z;
+    y->cdr = x;
+    x = y;
+    /* Garbage. */
+    smal_alloc(my_cons_type);
+  }
+  return x;
+}
+
+static
+size_t check_list(my_cons *x)
+{
+  size_t n = 0;
+  for ( ; x; x = x->cdr ) {
+    my_cons *z = x->car;
+    assert(((size_t) z->car) & 1);
+    ++ n;
+  }
+  return n;
+}
+
+#if SMAL_INCREMENTAL && SMAL_PTHREAD
+/* Finish a collection started by the main thread. */
+static
+void *collect_thread(void *arg)
+{
+  smal_collect();
+  return arg;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0, *moved = 0, *h = 0;
+  size_t n;
+#if SMAL_INCREMENTAL
+  size_t steps = 0;
+#endif
+  smal_roots_4(x, y, moved, h);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = make_list();
+  smal_collect();
+  assert(live_n() == N * 2);
+
+#if SMAL_INCREMENTAL
+  assert(smal_collect_start());
+  assert(! smal_collect_start());
+  while ( smal_collect_step(20000) ) {
+    ++ steps;
+    /* Move the car of the last list element into a new cons,
+       hidden from the collector except through smal_write_barrier(). */
+    for ( y = x; y->cdr && ((my_cons*) y->cdr)->cdr; y = y->cdr )
+      ;
+    if ( y->cdr ) {
+      my_cons *last = y->cdr;
+      my_cons *z = smal_alloc(my_cons_type);
+      z->car = z->cdr = 0;
+      smal_write_barrier(z, &z->car, last->car);
+      smal_write_barrier(z, &z->cdr, moved);
+      moved = z;
+      z = 0;
+      smal_write_barrier(y, &y->cdr, 0);
+      last = 0;
+    }
+    y = 0;
+  }
+  fprintf(stderr, "steps = %lu\n", (unsigned long) steps);
+  assert(steps > 1);
+#endif
+
+  n = check_list(x);
+  for ( y = moved; y; y = y->cdr ) {
+    my_cons *z = y->car;
+    assert(((size_t) z->car) & 1);
+    ++ n;
+  }
+  y = 0;
+  assert(n == N);
+
+#if SMAL_INCREMENTAL && SMAL_PTHREAD
+  /* The mark queue is not left in this thread between steps. */
+  {
+    pthread_t t;
+    assert(smal_collect_start());
+    smal_collect_step(1);
+    assert(pthread_create(&t, 0, collect_thread, 0) == 0);
+    assert(pthread_join(t, 0) == 0);
+    assert(! smal_collect_step(0));
+  }
+  assert(check_list(x) + check_list(moved) == N);
+#endif
+
+  /* Collect floating garbage. */
+  smal_collect();
+  assert(live_n() == N * 2);
+
+  x = moved = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+#if SMAL_INCREMENTAL && SMAL_BUFFER_WRITE_BARRIER
+  /* A store into an old object during a collection is a mutation for the next one. */
+  {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = sizeof(my_cons);
+    desc.mark_func = my_cons_mark;
+    desc.mostly_unchanging = 1;
+    desc.collections_per_sweep = 1000;
+    h = smal_alloc(smal_type_for_desc(&desc));
+    h->car = h->cdr = 0;
+  }
+  smal_collect();
+  smal_collect();
+  assert(smal_collect_start());
+  y = smal_alloc(my_cons_type);
+  y->car = TAG(1); y->cdr = 0;
+  smal_write_barrier(h, &h->car, y);
+  y = 0;
+  while ( smal_collect_step(20000) )
+    ;
+  smal_collect();
+  assert(live_n() == 2);
+  for ( n = 0; n < N; ++ n ) {
+    y = smal_alloc(my_cons_type);
+    y->car = y->cdr = 0;
+  }
+  y = 0;
+  assert(((my_cons*) h->car)->car == TAG(1));
+  h = 0;
+#endif
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+typedef struct my_vector {
+  size_t n;
+  void *elems[0];
+} my_vector;
+
+static void *my_vector_mark(void *ptr)
+{
+  my_vector *v = ptr;
+  smal_mark_ptr_n(ptr, v->n, v->elems);
+  return 0;
+}
+
+#define N 10000 /* Spans several pages. */
+
+int main(int argc, char **argv)
+{
+  my_vector *v;
+  my_cons *x;
+  char *interior;
+  size_t i;
+  smal_roots_3(v, x, interior);
+
+  smal_page_size_init = 16 * 1024;
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  v = smal_alloc_size(sizeof(*v) + sizeof(v->elems[0]) * N, my_vector_mark, 0);
+  assert(v);
+  v->n = N;
+  for ( i = 0; i < N; ++ i ) {
+    x = smal_alloc(my_cons_type);
+    x->car = x->cdr = 0;
+    v->elems[i] = x;
+  }
+  x = 0;
+
+  {
+    smal_buffer *buf = smal_buffer_from_ptr(v);
+    assert(buf);
+    assert(buf->mmap_size > smal_page_size);
+    assert(buf->object_capacity == 1);
+    /* Every page of the span maps to the same buffer. */
+    assert(smal_buffer_from_ptr(&v->elems[N - 1]) == buf);
+    assert(smal_buffer_from_ptr(&v->elems[N / 2]) == buf);
+  }
+
+  /* Keep alive by an interior pointer only. */
+  interior = (char*) &v->elems[N / 2];
+  v = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == N + 1);
+  }
+
+  v = (my_vector*) smal_buffer_from_ptr(interior)->begin_ptr;
+  assert(v->n == N);
+  interior = 0;
+
+  /* Grow in place within the span, then move to a larger span. */
+  assert(smal_realloc(v, sizeof(*v) + sizeof(v->elems[0]) * (N + 1)) == v);
+  v = smal_realloc(v, sizeof(*v) + sizeof(v->elems[0]) * N * 2);
+  assert(v && v->n == N);
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == N + 1);
+  }
+
+  /* Unreachable spans are unmapped. */
+  v = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == 0);
+    assert(stats.buffer_n == 0);
+  }
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 100000
+
+/* An interior pointer into X. */
+#define INTERIOR(X) ((void*) ((char*) (X) + sizeof(my_oop)))
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0;
+  size_t i;
+  smal_roots_2(x, y);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  /* Each cons: car is a fresh cons, cdr is an interior pointer to the previous cons.
+     Returned cdrs and queued cars both pass through the prefetch FIFO. */
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = y->cdr = 0;
+    y->cdr = x ? INTERIOR(x) : 0;
+    x = y;
+    y = smal_alloc(my_cons_type);
+    y->car = y->cdr = 0;
+    x->car = INTERIOR(y);
+    /* Garbage. */
+    smal_alloc(my_cons_type);
+  }
+  y = 0;
+
+  smal_collect();
+  assert(live_n() == N * 2);
+  smal_collect();
+  assert(live_n() == N * 2);
+
+  /* Drop the first half of the list. */
+  for ( y = x, i = 0; i < N / 2 - 1; ++ i )
+    y = (void*) ((char*) y->cdr - sizeof(my_oop));
+  y->cdr = 0;
+  y = 0;
+  smal_collect();
+  assert(live_n() == N);
+
+  x = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,96 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+typedef struct my_vector {
+  size_t n;
+  void *elems[0];
+} my_vector;
+
+static void *my_vector_mark(void *ptr)
+{
+  my_vector *v = ptr;
+  smal_mark_ptr_n(ptr, v->n, v->elems);
+  return 0;
+}
+
+#define N 4000 /* Wider than one mark queue chunk. */
+#define DEPTH 3
+
+/* Each element is a list of DEPTH conses whose cars are conses. */
+static
+my_vector *make_vector()
+{
+  my_vector *v = smal_alloc_size(sizeof(*v) + sizeof(v->elems[0]) * N, my_vector_mark, 0);
+  size_t i, j;
+  v->n = 0;
+  for ( i = 0; i < N; ++ i ) {
+    my_cons *x = 0, *y;
+    for ( j = 0; j < DEPTH; ++ j ) {
+      y = smal_alloc(my_cons_type);
+      y->car = y->cdr = 0;
+      y->cdr = x;
+      x = y;
+      y = smal_alloc(my_cons_type);
+      y->car = y->cdr = 0;
+      x->car = y;
+      /* Garbage. */
+      smal_alloc(my_cons_type);
+    }
+    v->elems[i] = x;
+    v->n = i + 1;
+  }
+  return v;
+}
+
+int main(int argc, char **argv)
+{
+  my_vector *v = 0, *w = 0;
+#if SMAL_MARK_QUEUE
+  size_t overflow_n;
+#endif
+  int i;
+  smal_roots_2(v, w);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  v = make_vector();
+  w = make_vector();
+
+#if SMAL_MARK_QUEUE
+  /* No chunks beyond the first: overflow. */
+  smal_mark_queue_max = 1;
+  overflow_n = smal_mark_queue_overflow_n;
+#endif
+  for ( i = 0; i < 3; ++ i ) {
+    smal_collect();
+    assert(live_n() == (1 + N * DEPTH * 2) * 2);
+  }
+#if SMAL_MARK_QUEUE
+  assert(smal_mark_queue_overflow_n > overflow_n);
+
+  /* Unlimited: no overflow. */
+  smal_mark_queue_max = 0;
+  overflow_n = smal_mark_queue_overflow_n;
+  smal_collect();
+  assert(live_n() == (1 + N * DEPTH * 2) * 2);
+  assert(smal_mark_queue_overflow_n == overflow_n);
+  smal_mark_queue_max = 1;
+#endif
+
+  w = 0;
+  smal_collect();
+  assert(live_n() == 1 + N * DEPTH * 2);
+
+  v = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
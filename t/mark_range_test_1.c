@@ -0,0 +1,69 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+#include "my_cons.h"
+#include "smal/smal.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define N 100
+
+/* A conservative region: pointers at various offsets among non-pointers. */
+static size_t region[N * 4 + 2];
+
+void smal_collect_before_inner(void *tos) { }
+void smal_collect_before_mark() { }
+void smal_collect_after_mark() { }
+void smal_collect_before_sweep() { }
+void smal_collect_after_sweep() { }
+void smal_collect_mark_roots()
+{
+  smal_mark_ptr_range(0, region, region + N * 4 + 2);
+}
+
+int main(int argc, char **argv)
+{
+  size_t i, n = 0;
+  void *p;
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  for ( i = 0; i < N * 4; ++ i ) {
+    switch ( i % 4 ) {
+    case 0: /* Aligned pointer. */
+      region[i] = (size_t) smal_alloc(my_cons_type);
+      ++ n;
+      break;
+    case 1: /* Integers and other addresses. */
+      region[i] = i % 8 == 1 ? i : (size_t) &region[i];
+      break;
+    case 2: /* Interior pointer. */
+      region[i] = (size_t) smal_alloc(my_cons_type) + sizeof(void*) / 2;
+      ++ n;
+      break;
+    case 3:
+      region[i] = ~ (size_t) 0;
+      break;
+    }
+  }
+  p = smal_alloc(my_cons_type);
+#if ! SMAL_MARK_RANGE_ALIGNED
+  /* Straddles two words. */
+  memcpy((char*) &region[N * 4] + sizeof(int), &p, sizeof(p));
+  ++ n;
+#endif
+  p = 0;
+
+  smal_collect();
+  assert(live_n() == n);
+
+  memset(region, 0, sizeof(region));
+  smal_collect();
+  assert(live_n() == 0);
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -38,3 +38,10 @@ void _my_print_stats(const char *file, int line)
 }
 #define my_print_stats() _my_print_stats(__FILE__, __LINE__)
 
+size_t live_n()
+{
+  smal_stats stats = { 0 };
+  smal_global_stats(&stats);
+  return stats.live_n;
+}
+
@@ -0,0 +1,62 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+
+#include "my_cons.h"
+#include "smal/smal.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define N 2000
+
+/* Object sizes: powers of 2 and not. */
+static size_t sizes[] = { 8, 16, 24, 40, 64, 72, 200, 256, 1000 };
+#define SIZES_N (sizeof(sizes) / sizeof(sizes[0]))
+
+/* Interior pointers to every other object. */
+static void *region[SIZES_N * N / 2];
+
+void smal_collect_before_inner(void *tos) { }
+void smal_collect_before_mark() { }
+void smal_collect_after_mark() { }
+void smal_collect_before_sweep() { }
+void smal_collect_after_sweep() { }
+void smal_collect_mark_roots()
+{
+  smal_mark_ptr_range(0, region, region + SIZES_N * N / 2);
+}
+
+static
+void *no_mark(void *ptr)
+{
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t s, i, n = 0;
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  for ( s = 0; s < SIZES_N; ++ s ) {
+    smal_type *type = smal_type_for(sizes[s], no_mark, 0);
+    for ( i = 0; i < N; ++ i ) {
+      char *ptr = smal_alloc(type);
+      if ( i & 1 )
+	region[n ++] = ptr + (i % sizes[s]);
+    }
+  }
+
+  /* Each interior pointer marks only its own object. */
+  smal_collect();
+  assert(live_n() == n);
+
+  memset(region, 0, sizeof(region));
+  smal_collect();
+  assert(live_n() == 0);
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
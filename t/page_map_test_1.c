@@ -0,0 +1,63 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 100000
+
+int main(int argc, char **argv)
+{
+  my_cons *x, *y;
+  void *old;
+  size_t i;
+  int local;
+  smal_roots_2(x, y);
+
+#if SMAL_ARENA
+  /* Let mmap() scatter buffers. */
+  smal_arena_size = 0;
+#endif
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = 0;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = 0;
+    y->cdr = x;
+    x = y;
+  }
+  y = 0;
+
+  /* Every object maps to its buffer. */
+  for ( y = x; y; y = y->cdr ) {
+    smal_buffer *buf = smal_buffer_from_ptr(y);
+    assert(buf);
+    assert(buf->mmap_addr <= (void*) y && (void*) y < buf->mmap_addr + buf->mmap_size);
+  }
+
+  /* Other addresses do not. */
+  assert(! smal_buffer_from_ptr(0));
+  assert(! smal_buffer_from_ptr(&local));
+  assert(! smal_buffer_from_ptr(argv));
+  assert(! smal_buffer_from_ptr((void*) ~ 0UL));
+  assert(! smal_buffer_from_ptr((void*) ((~ 0UL) >> 1)));
+
+  smal_collect();
+  old = x;
+  x = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.buffer_n == 0);
+  }
+  assert(! smal_buffer_from_ptr(old));
+  old = 0;
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
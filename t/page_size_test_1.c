@@ -0,0 +1,64 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 100000
+
+int main(int argc, char **argv)
+{
+  my_cons *x, *y;
+  size_t i;
+  smal_roots_2(x, y);
+
+  /* Select buffer size before initialization. */
+  smal_page_size_init = 256 * 1024;
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+#if ! SMAL_PAGE_SIZE_FIXED
+  assert(smal_page_size == 256 * 1024);
+#endif
+  assert(((size_t) 1 << smal_page_shift) == smal_page_size);
+
+  x = 0;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = 0;
+    y->cdr = x;
+    x = y;
+  }
+  y = 0;
+
+  {
+    smal_buffer *buf = smal_buffer_from_ptr(x);
+    smal_stats stats = { 0 };
+    assert(buf);
+    assert(buf->mmap_size == smal_page_size);
+    assert(smal_addr_page_offset(buf->mmap_addr) == 0);
+    assert(buf->object_capacity > smal_page_size / sizeof(my_cons) / 2);
+    smal_global_stats(&stats);
+    assert(stats.buffer_n <= N / (smal_page_size / sizeof(my_cons)) + 2);
+  }
+
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == N);
+  }
+
+  x = 0;
+  smal_collect();
+  {
+    smal_stats stats = { 0 };
+    smal_global_stats(&stats);
+    assert(stats.live_n == 0);
+    assert(stats.buffer_n == 0);
+  }
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
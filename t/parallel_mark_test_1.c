@@ -0,0 +1,64 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define DEPTH 17
+
+static
+my_cons *make_tree(int depth)
+{
+  my_cons *x;
+  if ( depth == 0 )
+    return 0;
+  x = smal_alloc(my_cons_type);
+  x->car = x->cdr = 0;
+  x->car = make_tree(depth - 1);
+  x->cdr = make_tree(depth - 1);
+  /* Garbage. */
+  smal_alloc(my_cons_type);
+  return x;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0;
+  int i;
+  smal_roots_2(x, y);
+
+#if SMAL_PARALLEL_MARK
+  smal_mark_threads = 4;
+#endif
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  x = make_tree(DEPTH);
+  y = make_tree(DEPTH);
+  for ( i = 0; i < 4; ++ i ) {
+    smal_collect();
+    assert(live_n() == ((1 << DEPTH) - 1) * 2);
+  }
+
+  /* Drop one tree. */
+  y = 0;
+  smal_collect();
+  assert(live_n() == (1 << DEPTH) - 1);
+
+  /* Fewer threads. */
+#if SMAL_PARALLEL_MARK
+  smal_mark_threads = 2;
+#endif
+  y = make_tree(DEPTH);
+  smal_collect();
+  assert(live_n() == ((1 << DEPTH) - 1) * 2);
+
+  x = y = 0;
+  smal_collect();
+  assert(live_n() == 0);
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
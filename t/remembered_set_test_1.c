@@ -16,6 +16,15 @@ int run_test(int argc, char **argv, int alloc_n)
   my_cons *xp = 0, *yp = 0;
   smal_type *my_cons_type_mu; /* mostly_unchanging */
   smal_roots_4(x, y, xp, yp);
+
+#if SMAL_SOFT_DIRTY
+  /* Counts mutations as they fault, not as smal_collect() finds them. */
+  smal_soft_dirty = 0;
+#endif
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  /* Keep tracking mutation however often it happens. */
+  smal_write_barrier_adapt = 0;
+#endif
   
 #if 0
   smal_debug_set_level(smal_debug_remembered_set, 9);
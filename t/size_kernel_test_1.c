@@ -0,0 +1,69 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+#include <time.h>
+
+/* Override for benchmarking: see "make size-kernels-vs". */
+#ifndef N
+#define N 200000
+#endif
+#ifndef R
+#define R 5
+#endif
+
+/* Kernel sizes and neighbouring generic sizes. */
+static size_t sizes[] = { 16, 24, 32, 40, 48, 56 };
+#define SIZES_N (sizeof(sizes) / sizeof(sizes[0]))
+
+static
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0;
+  size_t s, i, r;
+  smal_roots_2(x, y);
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+
+  for ( s = 0; s < SIZES_N; ++ s ) {
+    smal_type *type = smal_type_for(sizes[s], my_cons_mark, 0);
+    double t0 = now();
+
+#if SMAL_SIZE_KERNELS
+    assert(! type->kernel == (sizes[s] == 40 || sizes[s] == 56));
+#endif
+
+    for ( r = 0; r < R; ++ r ) {
+      /* Allocate a list; every other cell is garbage. */
+      for ( i = 0; i < N; ++ i ) {
+	y = smal_alloc(type);
+	y->car = 0;
+	y->cdr = i & 1 ? x : 0;
+	if ( i & 1 )
+	  x = y;
+      }
+      y = 0;
+      smal_collect();
+      assert(live_n() >= N / 2);
+      x = 0;
+      smal_collect();
+      assert(live_n() == 0);
+    }
+
+    fprintf(stderr, "  object_size %3lu: %.3f sec\n", (unsigned long) sizes[s], now() - t0);
+  }
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
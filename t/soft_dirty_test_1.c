@@ -0,0 +1,76 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 2000
+
+static
+size_t mutations()
+{
+  smal_stats stats = { 0 };
+  smal_global_stats(&stats);
+  return stats.buffer_mutations;
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *y = 0;
+  size_t i, m;
+  smal_roots_2(x, y);
+
+  {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = sizeof(my_cons);
+    desc.mark_func = my_cons_mark;
+    desc.mostly_unchanging = 1;
+    my_cons_type = smal_type_for_desc(&desc);
+  }
+#if SMAL_SOFT_DIRTY
+  fprintf(stderr, "smal_soft_dirty = %d\n", smal_soft_dirty);
+#endif
+
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(my_cons_type);
+    y->car = (void*) 1;
+    y->cdr = x;
+    x = y;
+  }
+  y = 0;
+  smal_collect();
+
+  /* No writes: no mutations. */
+  m = mutations();
+  smal_collect();
+  smal_collect();
+  assert(mutations() == m);
+
+  /* An uninstrumented store. */
+  x->car = (void*) 3;
+  smal_collect();
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(mutations() == m + 1);
+#endif
+
+  /* Tracking restarts after each collection. */
+  smal_collect();
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(mutations() == m + 1);
+#endif
+
+  for ( y = x, i = 0; y; y = y->cdr )
+    ++ i;
+  assert(i == N);
+
+  x = 0;
+  smal_collect();
+  smal_collect();
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
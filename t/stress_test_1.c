@@ -16,7 +16,7 @@ int my_count_object(smal_type *type, void *ptr, void *arg)
 int main(int argc, char **argv)
 {
   unsigned long 
-    smal_alloc_n = 0, 
+    smal_alloc_count = 0, 
     smal_each_object_n = 0, 
     smal_collect_n = 0;
 
@@ -29,7 +29,7 @@ int main(int argc, char **argv)
   for ( alloc_id = 0; alloc_id < 10000000; ++ alloc_id ) {
     int action = rand() % 10;
     x = smal_alloc(my_cons_type);
-    ++ smal_alloc_n;
+    ++ smal_alloc_count;
     
     x->car = x->cdr = 0;
     
@@ -90,7 +90,7 @@ int main(int argc, char **argv)
   smal_shutdown();
   
   fprintf(stdout, "\nOK\n");
-  fprintf(stdout, "%lu smal_alloc\n", smal_alloc_n);
+  fprintf(stdout, "%lu smal_alloc\n", smal_alloc_count);
   fprintf(stdout, "%lu smal_each_object\n", smal_each_object_n);
   fprintf(stdout, "%lu smal_collect\n", smal_collect_n);
   
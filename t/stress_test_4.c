@@ -18,7 +18,7 @@ int my_count_object(smal_type *type, void *ptr, void *arg)
 
 static
   unsigned long 
-    smal_alloc_n = 0, 
+    smal_alloc_count = 0, 
     smal_each_object_n = 0, 
     smal_collect_n = 0;
 
@@ -33,7 +33,7 @@ void run_test()
   for ( alloc_id = 0; alloc_id < 10000000; ++ alloc_id ) {
     int action = rand() % 10;
     x = smal_alloc(my_cons_type);
-    ++ smal_alloc_n;
+    ++ smal_alloc_count;
     
     x->car = x->cdr = 0;
     
@@ -88,7 +88,7 @@ void run_test()
   {
     smal_stats stats = { 0 };
     smal_global_stats(&stats);
-    assert(stats.alloc_id == smal_alloc_n);
+    assert(stats.alloc_id == smal_alloc_count);
     assert(stats.free_id < stats.alloc_id);
   }
 
@@ -108,7 +108,7 @@ int main(int argc, char **argv)
   {
     smal_stats stats = { 0 };
     smal_global_stats(&stats);
-    assert(stats.alloc_id == smal_alloc_n);
+    assert(stats.alloc_id == smal_alloc_count);
     // assert(stats.free_id == stats.alloc_id);
   }
 
@@ -117,7 +117,7 @@ int main(int argc, char **argv)
 #endif
 
   fprintf(stdout, "\nOK\n");
-  fprintf(stdout, "%lu smal_alloc\n", smal_alloc_n);
+  fprintf(stdout, "%lu smal_alloc\n", smal_alloc_count);
   fprintf(stdout, "%lu smal_each_object\n", smal_each_object_n);
   fprintf(stdout, "%lu smal_collect\n", smal_collect_n);
   
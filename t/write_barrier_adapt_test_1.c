@@ -0,0 +1,185 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 2000
+#define STRIDE 16
+#define K 3
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+static
+void type_stats(smal_type *type, smal_stats *s)
+{
+  memset(s, 0, sizeof(*s));
+  smal_type_stats(type, s);
+}
+
+static
+my_cons *make_list(smal_type *type)
+{
+  my_cons *x = 0, *y;
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(type);
+    y->car = TAG(i);
+    y->cdr = x;
+    x = y;
+  }
+  return x;
+}
+
+/* Store new my_cons_type objects into every STRIDE-th car of x. */
+static
+void mutate(my_cons *x, size_t r)
+{
+  size_t i;
+  for ( i = 0; x; x = x->cdr, ++ i ) {
+    if ( i % STRIDE == 0 ) {
+      my_cons *z = smal_alloc(my_cons_type);
+      z->car = TAG(r); z->cdr = 0;
+      x->car = z;
+    }
+  }
+}
+
+/* Allocate garbage, so freed objects are overwritten. */
+static
+void garbage()
+{
+  size_t i;
+  for ( i = 0; i < N; ++ i ) {
+    my_cons *g = smal_alloc(my_cons_type);
+    g->car = g->cdr = 0;
+  }
+}
+
+/* Every STRIDE-th car of x is a my_cons_type object holding TAG(r). */
+static
+void check(my_cons *x, size_t r)
+{
+  size_t i;
+  for ( i = 0; x; x = x->cdr, ++ i ) {
+    if ( i % STRIDE == 0 )
+      assert(((my_cons*) x->car)->car == TAG(r));
+  }
+  assert(i == N);
+}
+
+int main(int argc, char **argv)
+{
+  my_cons *x = 0, *q = 0, *z = 0;
+  smal_type *mu_type;
+  smal_stats s0, s1;
+  size_t r;
+  smal_roots_3(x, q, z);
+
+#if SMAL_SOFT_DIRTY
+  /* Counts mutations as they fault. */
+  smal_soft_dirty = 0;
+#endif
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+  {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = sizeof(my_cons);
+    desc.mark_func = my_cons_mark;
+    desc.mostly_unchanging = 1;
+#if SMAL_BUFFER_WRITE_BARRIER
+    /* Rely on remembered sets between sweeps. */
+    desc.collections_per_sweep = 1000;
+#endif
+    mu_type = smal_type_for_desc(&desc);
+  }
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  smal_write_barrier_adapt = K;
+#endif
+
+  x = make_list(mu_type);
+  smal_collect();
+  smal_collect();
+
+  /* Mutated in K consecutive collections: stop tracking. */
+  for ( r = 0; r < K; ++ r ) {
+    mutate(x, r);
+    garbage();
+    smal_collect();
+    check(x, r);
+  }
+  type_stats(mu_type, &s0);
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  assert(s0.write_barrier_disables == s0.buffer_n);
+  assert(s0.write_barrier_enables == 0);
+#endif
+
+  /* Untracked: no faults, marked on every collection. */
+  for ( ; r < K * 2; ++ r ) {
+    mutate(x, r);
+    garbage();
+    smal_collect();
+    check(x, r);
+  }
+  type_stats(mu_type, &s1);
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  assert(s1.buffer_mutations == s0.buffer_mutations);
+#endif
+
+  /* Untracked for K << 1 collections: track again. */
+  for ( r = 0; r < K * 2; ++ r ) {
+    garbage();
+    smal_collect();
+    check(x, K * 2 - 1);
+  }
+  type_stats(mu_type, &s0);
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  assert(s0.write_barrier_enables == s0.buffer_n);
+#endif
+  mutate(x, 100);
+  type_stats(mu_type, &s1);
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(s1.buffer_mutations > s0.buffer_mutations);
+#endif
+  garbage();
+  smal_collect();
+  check(x, 100);
+  garbage();
+  smal_collect();
+  check(x, 100);
+
+#if SMAL_GENERATIONAL
+  /* Buffers of other types track mutation after minor collections. */
+  {
+    smal_type *quiet_type = smal_type_for(sizeof(my_cons) * 2, my_cons_mark, 0);
+    q = make_list(quiet_type);
+    smal_collect();
+    for ( r = 0; r < K; ++ r )
+      smal_collect_minor();
+
+    /* A young object stored into a tracked old one survives a minor collection. */
+    z = smal_alloc(my_cons_type);
+    z->car = TAG(7); z->cdr = 0;
+    type_stats(quiet_type, &s0);
+    q->car = z;
+    type_stats(quiet_type, &s1);
+#if SMAL_BUFFER_WRITE_BARRIER
+    assert(s1.buffer_mutations == s0.buffer_mutations + 1);
+#endif
+    z = 0;
+    smal_collect_minor();
+    garbage();
+    smal_collect_minor();
+    assert(((my_cons*) q->car)->car == TAG(7));
+  }
+#endif
+
+  x = q = 0;
+  smal_collect();
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*
+  SMAL
+  Copyright (c) 2011 Kurt A. Stephens
+*/
+#include "my_cons.h"
+#include "roots_explicit.h"
+
+#define N 4000
+#define TAG(I) ((void*) (((I) << 1) | 1))
+
+/* A cons with an extra reference, so some objects straddle OS pages. */
+typedef struct my_triple {
+  my_oop car, cdr, extra;
+} my_triple;
+
+static void * my_triple_mark (void *ptr)
+{
+  smal_mark_ptr(ptr, ((my_triple *) ptr)->car);
+  smal_mark_ptr(ptr, ((my_triple *) ptr)->extra);
+  return ((my_triple *) ptr)->cdr;
+}
+
+static
+void stats(smal_stats *s)
+{
+  memset(s, 0, sizeof(*s));
+  smal_global_stats(s);
+}
+
+static
+size_t os_page(void *ptr)
+{
+  return (size_t) ptr / getpagesize();
+}
+
+static
+size_t buffer_page(void *ptr)
+{
+  return (size_t) ptr / smal_page_size;
+}
+
+/* Store a new my_cons_type object into *field; returns it. */
+static
+my_cons *store_new(void **field, size_t i)
+{
+  my_cons *z = smal_alloc(my_cons_type);
+  z->car = TAG(i); z->cdr = 0;
+  *field = z;
+  return z;
+}
+
+/* Allocate garbage, collect and check z survived. */
+static
+void collect_check(my_cons *z, size_t i)
+{
+  size_t j;
+  for ( j = 0; j < N; ++ j ) {
+    my_cons *g = smal_alloc(my_cons_type);
+    g->car = g->cdr = 0;
+  }
+  smal_collect();
+  assert(z->car == TAG(i));
+}
+
+int main(int argc, char **argv)
+{
+  my_triple *x = 0, *y = 0, *a = 0, *b = 0;
+  my_cons *z = 0;
+  smal_type *triple_type;
+  smal_stats s0, s1;
+  size_t i;
+  smal_roots_5(x, y, a, b, z);
+
+#if SMAL_SOFT_DIRTY
+  /* Counts slices as they fault. */
+  smal_soft_dirty = 0;
+#endif
+#if SMAL_ADAPTIVE_WRITE_BARRIER
+  /* Keep tracking mutation however often it happens. */
+  smal_write_barrier_adapt = 0;
+#endif
+
+  my_cons_type = smal_type_for(sizeof(my_cons), my_cons_mark, 0);
+  {
+    smal_type_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.object_size = sizeof(my_triple);
+    desc.mark_func = my_triple_mark;
+    desc.mostly_unchanging = 1;
+#if SMAL_BUFFER_WRITE_BARRIER
+    /* Rely on remembered sets between sweeps. */
+    desc.collections_per_sweep = 1000;
+#endif
+    triple_type = smal_type_for_desc(&desc);
+  }
+
+  for ( i = 0; i < N; ++ i ) {
+    y = smal_alloc(triple_type);
+    y->car = TAG(i);
+    y->extra = 0;
+    y->cdr = x;
+    x = y;
+  }
+  y = 0;
+  smal_collect();
+  smal_collect();
+
+  /* Two objects in one buffer, with extra on different OS pages. */
+  for ( a = x; a; a = a->cdr ) {
+    for ( b = a->cdr; b; b = b->cdr )
+      if ( buffer_page(a) == buffer_page(b) && os_page(&a->extra) != os_page(&b->extra) )
+	break;
+    if ( b )
+      break;
+  }
+  assert(a && b);
+
+  /* Each OS page faults separately; the buffer is mutated once. */
+  stats(&s0);
+  store_new(&a->extra, 1);
+  stats(&s1);
+#if SMAL_WRITE_BARRIER_SLICES
+  assert(s1.slice_mutations == s0.slice_mutations + 1);
+#endif
+  z = store_new(&b->extra, 2);
+  stats(&s1);
+#if SMAL_WRITE_BARRIER_SLICES
+  assert(s1.slice_mutations == s0.slice_mutations + 2);
+#endif
+#if SMAL_BUFFER_WRITE_BARRIER
+  assert(s1.buffer_mutations == s0.buffer_mutations + 1);
+#endif
+
+  /* The references from dirty slices are remembered again. */
+  z = 0;
+  collect_check(b->extra, 2);
+  collect_check(a->extra, 1);
+  collect_check(b->extra, 2);
+
+  /* A store to the part of an object on the next OS page. */
+  for ( a = x; a; a = a->cdr )
+    if ( os_page(a) != os_page(&a->extra) )
+      break;
+  if ( a ) {
+    store_new(&a->extra, 3);
+    collect_check(a->extra, 3);
+    collect_check(a->extra, 3);
+  } else {
+    fprintf(stderr, "  no object straddles an OS page\n");
+  }
+
+#if SMAL_GENERATIONAL
+  b = x->cdr;
+  store_new(&b->extra, 4);
+  smal_collect_minor();
+  assert(((my_cons*) b->extra)->car == TAG(4));
+  collect_check(b->extra, 4);
+#endif
+
+  for ( y = x, i = N; y; y = y->cdr )
+    assert(y->car == TAG(-- i));
+  assert(i == 0);
+
+  x = y = a = b = 0;
+  smal_collect();
+  smal_collect();
+
+  smal_roots_end();
+
+  fprintf(stderr, "\n%s OK\n", argv[0]);
+  return 0;
+}